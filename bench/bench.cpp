@@ -0,0 +1,203 @@
+#include "logifix.h"
+#include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <sys/resource.h>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+extern std::unordered_map<std::string,
+                          std::tuple<std::string, std::string, std::string, bool,
+                                     std::vector<std::string>, bool>>
+    rule_data;
+
+namespace bench {
+
+using steady_clock = std::chrono::steady_clock;
+
+/* the rewrite graph of an input is not explored further beyond this */
+constexpr auto MAX_FILE_MEMORY = std::size_t{512 * 1024 * 1024};
+
+struct input {
+    std::string name;
+    std::string source;
+};
+
+auto read_file(const std::filesystem::path& path) -> std::string {
+    auto f = std::ifstream(path);
+    auto ss = std::stringstream{};
+    ss << f.rdbuf();
+    return ss.str();
+}
+
+/**
+ * A method body nested the given number of levels deep.
+ */
+auto deep_nesting(size_t depth) -> std::string {
+    auto result = std::string{"import java.util.List;\n\nclass DeepNesting {\n"};
+    result += "    void test(List<Integer> list) {\n";
+    for (auto i = std::size_t{}; i < depth; i++) {
+        result += fmt::format("{:{}}if (list.size() > {}) {{\n", "", 8 + i * 4, i);
+    }
+    result += fmt::format("{:{}}System.out.println(list.size() == 0);\n", "", 8 + depth * 4);
+    for (auto i = depth; i > 0; i--) {
+        result += fmt::format("{:{}}}}\n", "", 4 + i * 4);
+    }
+    result += "    }\n}\n";
+    return result;
+}
+
+/**
+ * A class with a long list of imports, each of them used by a field.
+ */
+auto long_imports(size_t count) -> std::string {
+    auto result = std::string{};
+    for (auto i = std::size_t{}; i < count; i++) {
+        result += fmt::format("import com.example.package{}.Class{};\n", i % 97, i);
+    }
+    result += "\nclass LongImports {\n";
+    for (auto i = std::size_t{}; i < count; i++) {
+        result += fmt::format("    Class{} field{};\n", i, i);
+    }
+    result += "}\n";
+    return result;
+}
+
+/**
+ * A class with the given number of methods that many rules match on but
+ * none rewrite. The rewrite graph of a file grows with the square of its
+ * findings, so generated inputs must have few of them.
+ */
+auto many_methods(size_t count) -> std::string {
+    auto result = std::string{"import java.util.List;\nimport java.util.Map;\n\n"};
+    result += "class ManyMethods {\n";
+    for (auto i = std::size_t{}; i < count; i++) {
+        result += fmt::format(
+            "    int method{}(List<Integer> list, Map<String, Integer> map) {{\n", i);
+        result += fmt::format("        int total = {};\n", i);
+        result += "        for (Integer value : list) {\n";
+        result += fmt::format("            total += value * map.getOrDefault(\"key{}\", 1);\n", i);
+        result += "        }\n";
+        result += fmt::format("        return total > {} ? total : -total;\n", i);
+        result += "    }\n";
+    }
+    result += "}\n";
+    return result;
+}
+
+auto collect_inputs(const std::vector<std::string>& paths) -> std::vector<input> {
+    auto result = std::vector<input>{};
+    for (const auto& path : paths) {
+        for (const auto& entry : std::filesystem::recursive_directory_iterator(path)) {
+            if (entry.is_regular_file() && entry.path().extension() == ".java") {
+                result.push_back({entry.path().string(), read_file(entry.path())});
+            }
+        }
+    }
+    std::sort(result.begin(), result.end(),
+              [](const input& a, const input& b) { return a.name < b.name; });
+    result.push_back({"synthetic/deep_nesting.java", deep_nesting(200)});
+    result.push_back({"synthetic/long_imports.java", long_imports(2000)});
+    result.push_back({"synthetic/many_methods.java", many_methods(1000)});
+    return result;
+}
+
+auto configure(logifix::program& program) -> void {
+    /* a merge conflict in one input must not end the benchmark */
+    program.set_conflict_policy(logifix::conflict_policy::drop_patch);
+    /* nor may an input with many findings exhaust the memory */
+    program.set_memory_limit(MAX_FILE_MEMORY);
+    for (const auto& [rule, data] : rule_data) {
+        program.set_rule_triggers(rule, std::get<4>(data));
+        if (std::get<5>(data)) {
+            program.add_file_level_rule(rule);
+        }
+    }
+}
+
+/**
+ * Analyze the inputs in a single program and return the number of nodes
+ * in the resulting rewrite graphs and the number of inputs that were cut
+ * short by the memory limit.
+ */
+auto analyze(const std::vector<input>& inputs) -> std::pair<size_t, size_t> {
+    auto program = logifix::program{};
+    configure(program);
+    auto files = std::vector<logifix::node_id>{};
+    for (const auto& input : inputs) {
+        files.emplace_back(program.add_file(input.source));
+    }
+    program.run();
+    auto nodes = std::size_t{};
+    for (auto file : files) {
+        nodes += program.get_graph_statistics(file).nodes;
+    }
+    return {nodes, program.get_memory_limited_files().size()};
+}
+
+auto percentile(std::vector<double> values, double p) -> double {
+    if (values.empty()) {
+        return 0;
+    }
+    std::sort(values.begin(), values.end());
+    auto index = static_cast<size_t>(p * double(values.size() - 1) + 0.5);
+    return values[index];
+}
+
+/* peak resident set size in kilobytes */
+auto peak_rss() -> long {
+    auto usage = rusage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+} // namespace bench
+
+/**
+ * Run the engine over the rule test corpus and a few generated files and
+ * print the results as json. Every file is first analyzed on its own to
+ * measure latency, then all files are analyzed together to measure
+ * throughput.
+ */
+auto main(int argc, char** argv) -> int {
+    auto paths = std::vector<std::string>(argv + 1, argv + argc);
+    if (paths.empty()) {
+        paths.emplace_back(LOGIFIX_RULES_DIR);
+    }
+    auto inputs = bench::collect_inputs(paths);
+
+    auto latencies = std::vector<double>{};
+    auto slowest = std::pair<double, std::string>{};
+    for (const auto& input : inputs) {
+        auto start = bench::steady_clock::now();
+        bench::analyze({input});
+        auto seconds = std::chrono::duration<double>(bench::steady_clock::now() - start).count();
+        latencies.emplace_back(seconds);
+        slowest = std::max(slowest, std::pair(seconds, input.name));
+    }
+
+    auto start = bench::steady_clock::now();
+    auto [nodes, memory_limited_files] = bench::analyze(inputs);
+    auto seconds = std::chrono::duration<double>(bench::steady_clock::now() - start).count();
+
+    fmt::print("{{\n");
+    fmt::print("    \"files\": {},\n", inputs.size());
+    fmt::print("    \"nodes\": {},\n", nodes);
+    fmt::print("    \"memory_limited_files\": {},\n", memory_limited_files);
+    fmt::print("    \"seconds\": {:.3f},\n", seconds);
+    fmt::print("    \"files_per_second\": {:.2f},\n", double(inputs.size()) / seconds);
+    fmt::print("    \"nodes_per_second\": {:.2f},\n", double(nodes) / seconds);
+    fmt::print("    \"latency_p50\": {:.6f},\n", bench::percentile(latencies, 0.5));
+    fmt::print("    \"latency_p99\": {:.6f},\n", bench::percentile(latencies, 0.99));
+    fmt::print("    \"slowest_file\": \"{}\",\n", utils::json_escape(slowest.second));
+    fmt::print("    \"peak_rss_kb\": {}\n", bench::peak_rss());
+    fmt::print("}}\n");
+    return 0;
+}
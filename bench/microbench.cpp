@@ -0,0 +1,145 @@
+#include "functors.h"
+#include "logifix.h"
+#include "parser.h"
+#include "patch.h"
+#include <chrono>
+#include <fmt/core.h>
+#include <fmt/format.h>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace microbench {
+
+using steady_clock = std::chrono::steady_clock;
+
+constexpr auto MIN_ITERATIONS = std::size_t{3};
+constexpr auto MIN_DURATION = std::chrono::milliseconds{200};
+
+/**
+ * A class with the given number of methods. The parser copies the nodes of
+ * parenthesized expressions, which should not get slower as the file grows.
+ */
+auto make_class(size_t methods) -> std::string {
+    auto result = std::string{"import java.util.List;\nimport java.util.Map;\n\nclass Test {\n"};
+    for (auto i = std::size_t{}; i < methods; i++) {
+        result +=
+            fmt::format("    int method{}(List<Integer> list, Map<String, Integer> map) {{\n", i);
+        result += "        if (list.size() == 0) {\n";
+        result += "            return 0;\n";
+        result += "        }\n";
+        result += fmt::format("        return (map.get(\"key{}\")) + (list.size());\n", i);
+        result += "    }\n";
+    }
+    result += "}\n";
+    return result;
+}
+
+/**
+ * One rewrite per method, replacing `list.size() == 0` with `list.isEmpty()`.
+ */
+auto make_rewrites(const std::string& source) -> logifix::rewrite_collection {
+    auto result = logifix::rewrite_collection{};
+    const auto pattern = std::string{"list.size() == 0"};
+    for (auto pos = source.find(pattern); pos != std::string::npos;
+         pos = source.find(pattern, pos + 1)) {
+        result.emplace_back(pos, pos + pattern.size(), "list.isEmpty()");
+    }
+    return result;
+}
+
+/**
+ * Run the function until both the minimum number of iterations and the
+ * minimum duration have been reached, and return the mean time per
+ * iteration in seconds.
+ */
+auto measure(const std::function<void()>& fn) -> double {
+    auto iterations = std::size_t{};
+    auto start = steady_clock::now();
+    while (iterations < MIN_ITERATIONS || steady_clock::now() - start < MIN_DURATION) {
+        fn();
+        iterations++;
+    }
+    return std::chrono::duration<double>(steady_clock::now() - start).count() /
+           double(iterations);
+}
+
+} // namespace microbench
+
+/**
+ * Time the individual stages of the pipeline on inputs of increasing size
+ * and print the results as json. The time per byte should stay roughly
+ * constant for a stage that scales linearly.
+ */
+auto main() -> int {
+    auto program = logifix::program{};
+    auto results = std::vector<std::string>{};
+    auto report = [&results](const std::string& name, const std::string& input, double seconds) {
+        results.emplace_back(fmt::format(
+            "    {{\"name\": \"{}\", \"bytes\": {}, \"seconds\": {:.9f}, \"ns_per_byte\": {:.3f}}}",
+            name, input.size(), seconds, seconds * 1e9 / double(input.size())));
+    };
+
+    for (auto methods = std::size_t{16}; methods <= 2048; methods *= 2) {
+        auto before = microbench::make_class(methods);
+        auto rewrites = microbench::make_rewrites(before);
+        auto after = program.apply_rewrites(before, rewrites);
+        auto tokens = *logifix::parser::lex(before);
+
+        report("lex", before, microbench::measure([&] { logifix::parser::lex(before); }));
+
+        report("instantiate", before, microbench::measure([&] {
+                   auto prog = std::unique_ptr<souffle::SouffleProgram>(
+                       souffle::ProgramFactory::newInstance("logifix"));
+               }));
+
+        report("parse", before, microbench::measure([&] {
+                   auto prog = std::unique_ptr<souffle::SouffleProgram>(
+                       souffle::ProgramFactory::newInstance("logifix"));
+                   auto state = logifix::functors::scoped_program(&prog->getSymbolTable(), before);
+                   logifix::parser::parse(prog.get(), "file", tokens);
+               }));
+
+        /* parse time should be a small part of the time of a whole analysis */
+        report("analyze", before, microbench::measure([&] {
+                   auto prog = std::unique_ptr<souffle::SouffleProgram>(
+                       souffle::ProgramFactory::newInstance("logifix"));
+                   auto state = logifix::functors::scoped_program(&prog->getSymbolTable(), before);
+                   logifix::parser::parse(prog.get(), "file", tokens);
+                   prog->run();
+               }));
+
+        /* a single rewrite of the whole class body, as produced by rules
+         * that rewrite large enclosing nodes */
+        auto body_start = before.find('{');
+        auto body_end = before.rfind('}') + 1;
+        auto after_body_end = after.rfind('}') + 1;
+        auto whole_body = logifix::rewrite_type{
+            body_start, body_end, after.substr(body_start, after_body_end - body_start)};
+        report("split_rewrite", before,
+               microbench::measure([&] { program.split_rewrite(before, whole_body); }));
+
+        report("apply_rewrites", before,
+               microbench::measure([&] { program.apply_rewrites(before, rewrites); }));
+
+        report("create_patch", before,
+               microbench::measure([&] { cli::create_patch("Test.java", before, after); }));
+
+        report("post_process_harmonize_line_terminators", before, microbench::measure([&] {
+                   cli::post_process_harmonize_line_terminators(before, after);
+               }));
+        report("post_process_auto_indent", before, microbench::measure([&] {
+                   cli::post_process_auto_indent(before, after);
+               }));
+        report("post_process_sort_imports", before, microbench::measure([&] {
+                   cli::post_process_sort_imports(before, after);
+               }));
+        report("post_process_remove_introduced_empty_lines", before, microbench::measure([&] {
+                   cli::post_process_remove_introduced_empty_lines(before, after);
+               }));
+    }
+
+    fmt::print("[\n{}\n]\n", fmt::join(results, ",\n"));
+    return 0;
+}
@@ -10,7 +10,7 @@ function generate {
     echo "#include <unordered_map>"
     echo "#include <string>"
     echo ""
-    echo "std::unordered_map<std::string, std::tuple<std::string, std::string, std::string, bool>> rule_data = {"
+    echo "std::unordered_map<std::string, std::tuple<std::string, std::string, std::string, bool, std::vector<std::string>, bool>> rule_data = {"
 
     for f in $SCRIPT_DIR/../src/rules/*; do
         json_file="$f/data.json"
@@ -21,6 +21,10 @@ function generate {
 
             jq -c '.sonar.id, .pmd.id, .description, .disabled_by_default // false' $json_file | tr '\n' ','
 
+            jq -r '"{" + ((.triggers // []) | map(@json) | join(",")) + "},"' $json_file | tr -d '\n'
+
+            jq -c '.file_level // false' $json_file | tr -d '\n'
+
             echo "}},"
             
         fi
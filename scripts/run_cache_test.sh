@@ -0,0 +1,18 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+logifix_cli="$1"
+test_file="$2"
+diff_file="$3"
+
+cache=$(mktemp -d)
+trap 'rm -rf "$cache"' EXIT
+
+echo $test_file
+cd $(dirname $test_file)
+# the first run fills the cache and the second run reads from it
+for run in 1 2; do
+    diff <($logifix_cli --patch --accept-all --enable-all --cache="$cache" "$(basename $test_file)") "$(basename $diff_file)"
+done
@@ -0,0 +1,14 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+logifix_cli="$1"
+test_file="$2"
+expected_file="$3"
+# the remaining arguments are passed on to logifix
+shift 3
+
+echo $test_file
+cd $(dirname $test_file)
+diff <($logifix_cli "$@" "$(basename $test_file)") "$expected_file"
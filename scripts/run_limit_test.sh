@@ -0,0 +1,46 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+logifix_cli="$1"
+test_file="$2"
+diff_file="$3"
+# the limit that the generated file exceeds
+limit="$4"
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+echo $test_file
+cp "$test_file" "$work_dir"
+cd "$work_dir"
+case "$limit" in
+    timeout)
+        # parsing and analyzing a few hundred thousand statements takes
+        # longer than the smallest timeout
+        flags="--timeout=1"
+        summary="Skipped 1 files that timed out"
+        awk 'BEGIN {
+            print "class Large {\n    int test() {\n        int x = 0;";
+            for (i = 0; i < 200000; i++) print "        x++;";
+            print "        return x;\n    }\n}";
+        }' > Large.java
+        ;;
+    memory)
+        # a copy of the test file with a long comment, each of its nodes
+        # holds more than the smallest memory limit
+        flags="--max-file-memory=1"
+        summary="Skipped 1 files that exceeded the memory limit"
+        cat "$(basename $test_file)" > Large.java
+        awk 'BEGIN { printf "//"; for (i = 0; i < 20000; i++) printf "%0100d", 0; print "" }' \
+            >> Large.java
+        ;;
+    *)
+        echo "Unknown limit '$limit'"
+        exit 1
+        ;;
+esac
+# the generated file is reported as skipped and the test file is still patched
+diff <($logifix_cli --patch --accept-all --enable-all $flags "$(basename $test_file)" Large.java 2>stderr.txt) "$diff_file"
+grep -A1 "^$summary$" stderr.txt | grep -q "^    Large.java$"
@@ -0,0 +1,36 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+logifix_cli="$1"
+test_file="$2"
+other_file="$3"
+
+work_dir=$(mktemp -d)
+trap 'rm -rf "$work_dir"' EXIT
+
+echo $test_file
+mkdir "$work_dir/review" "$work_dir/in-place"
+for dir in review in-place; do
+    cp "$test_file" "$other_file" "$work_dir/$dir"
+done
+original_file="$test_file"
+test_file=$(basename $test_file)
+other_file=$(basename $other_file)
+
+# review starts while the files are analyzed: review patches by rule, pick
+# the first rule, accept its patch, go back and apply the changes
+cd "$work_dir/review"
+printf '\r\r\rhjj\r' | timeout 60 $logifix_cli "$test_file" "$other_file" >/dev/null
+if cmp -s "$test_file" "$original_file"; then
+    echo "The reviewed patch was not applied"
+    exit 1
+fi
+
+# the reviewed files must match the result of accepting all patches
+cd "$work_dir/in-place"
+$logifix_cli --in-place --accept-all "$test_file" "$other_file"
+for file in "$test_file" "$other_file"; do
+    diff "$work_dir/review/$file" "$file"
+done
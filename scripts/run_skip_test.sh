@@ -0,0 +1,13 @@
+#!/bin/bash
+
+set -e
+set -o pipefail
+
+logifix_cli="$1"
+test_file="$2"
+
+echo $test_file
+cd $(dirname $test_file)
+# the rule profile reports the number of Soufflé runs on stderr
+output=$($logifix_cli --patch --profile-rules "$(basename $test_file)" 2>&1 >/dev/null)
+grep -q "^0 Soufflé runs$" <<< "$output"
@@ -1,5 +1,8 @@
 #include "config.h"
 #include "logifix.h"
+#include "patch.h"
+#include "progress.h"
+#include "timer.h"
 #include "tty.h"
 #include "utils.h"
 #include <cctype>
@@ -10,8 +13,8 @@
 #include <fmt/color.h>
 #include <fmt/core.h>
 #include <iostream>
+#include <map>
 #include <mutex>
-#include <nway.h>
 #include <set>
 #include <stack>
 #include <string>
@@ -19,7 +22,9 @@
 #include <tuple>
 #include <unordered_map>
 
-extern std::unordered_map<std::string, std::tuple<std::string, std::string, std::string, bool>>
+extern std::unordered_map<std::string,
+                          std::tuple<std::string, std::string, std::string, bool,
+                                     std::vector<std::string>, bool>>
     rule_data;
 
 namespace cli {
@@ -34,6 +39,18 @@ struct options {
     bool enable_all;
     bool print_graphviz;
     bool print_json;
+    bool count;
+    bool report;
+    size_t timeout;
+    size_t max_file_memory;
+    size_t jobs;
+    size_t split_above;
+    std::string cache;
+    logifix::conflict_policy on_conflict;
+    std::string conflict_report;
+    std::string profile;
+    bool profile_rules;
+    std::string graph_stats;
     std::set<std::string> files;
     std::set<std::string> accepted;
     std::set<std::string> not_accepted;
@@ -59,100 +76,6 @@ auto replace_tabs_with_spaces(const std::string& str) -> std::string {
     return result;
 }
 
-auto create_patch(const std::string& filename, const std::string& before, const std::string& after)
-    -> std::vector<std::string> {
-    constexpr auto LINES_OF_CONTEXT = std::size_t{3};
-    auto a = utils::line_split(before);
-    auto b = utils::line_split(after);
-    for (auto& x : a) {
-        x = utils::rtrim(x);
-    }
-    for (auto& x : b) {
-        x = utils::rtrim(x);
-    }
-    auto changes = std::vector<std::tuple<bool, char, std::string>>{};
-    auto lcs = nway::lcs(a, b);
-    auto a_pos = std::size_t{};
-    auto b_pos = std::size_t{};
-    while (a_pos < a.size() || b_pos < b.size()) {
-        /* a and b agree */
-        while (a_pos < a.size() && lcs[a_pos] && *lcs[a_pos] == b_pos) {
-            changes.emplace_back(false, ' ', a[a_pos]);
-            a_pos++;
-            b_pos++;
-        }
-        /* a has no matching position */
-        while (a_pos < a.size() && !lcs[a_pos]) {
-            changes.emplace_back(false, '-', a[a_pos]);
-            a_pos++;
-        }
-        /* a has matching position but it is not that of b_pos */
-        while (a_pos < a.size() && lcs[a_pos] && *lcs[a_pos] != b_pos) {
-            changes.emplace_back(false, '+', b[b_pos]);
-            b_pos++;
-        }
-    }
-    /* 3 lines of context */
-    for (auto i = 0; i < changes.size(); i++) {
-        auto& [keep, marker, line] = changes[i];
-        auto start = std::max(0, i - int(LINES_OF_CONTEXT));
-        auto stop = std::min(int(changes.size()), i + int(LINES_OF_CONTEXT) + 1);
-        for (auto j = start; j < stop; j++) {
-            if (std::get<1>(changes[j]) != ' ') {
-                keep = true;
-            }
-        }
-    }
-    /* create patch output */
-    auto result = std::vector<std::string>{};
-    result.emplace_back(fmt::format("diff --git a/{} b/{}", filename, filename));
-    auto a_pos_output = std::size_t{1};
-    auto b_pos_output = std::size_t{1};
-    for (auto i = std::size_t{}; i < changes.size(); i++) {
-        auto& [keep, marker, line] = changes[i];
-        if (!keep) {
-            a_pos_output++;
-            b_pos_output++;
-            continue;
-        }
-        auto a_start = a_pos_output;
-        auto b_start = b_pos_output;
-        auto a_lines = std::size_t{};
-        auto b_lines = std::size_t{};
-        auto hunk_end = i;
-        while (hunk_end < changes.size() && std::get<0>(changes[hunk_end])) {
-            switch (std::get<1>(changes[hunk_end])) {
-            case ' ':
-                a_pos_output++;
-                b_pos_output++;
-                a_lines++;
-                b_lines++;
-                break;
-            case '-':
-                a_pos_output++;
-                a_lines++;
-                break;
-            case '+':
-                b_pos_output++;
-                b_lines++;
-                break;
-            default:
-                break;
-            }
-            hunk_end++;
-        }
-        /* output header */
-        result.emplace_back(fmt::format("@@ -{},{} +{},{} @@", a_start, a_lines, b_start, b_lines));
-        while (i < changes.size() && std::get<0>(changes[i])) {
-            result.emplace_back(
-                fmt::format("{}{}", std::get<1>(changes[i]), std::get<2>(changes[i])));
-            i++;
-        }
-        i--;
-    }
-    return result;
-}
-
 auto prettify_patch(const std::vector<std::string>& lines) -> std::vector<std::string> {
     auto columns = std::vector<std::pair<std::string, std::string>>{};
     if (lines.empty()) {
@@ -270,6 +193,18 @@ auto parse_options(int argc, char** argv) -> options {
         .enable_all = false,
         .print_graphviz = false,
         .print_json = false,
+        .count = false,
+        .report = false,
+        .timeout = 0,
+        .max_file_memory = 0,
+        .jobs = 0,
+        .split_above = 0,
+        .cache = {},
+        .on_conflict = logifix::conflict_policy::abort,
+        .conflict_report = {},
+        .profile = {},
+        .profile_rules = false,
+        .graph_stats = {},
         .files = {},
         .accepted = {},
         .not_accepted = {},
@@ -320,6 +255,21 @@ auto parse_options(int argc, char** argv) -> options {
         }
     };
 
+    auto parse_on_conflict = [&](const std::string& str) {
+        if (str == "abort") {
+            opts.on_conflict = logifix::conflict_policy::abort;
+        } else if (str == "drop-patch") {
+            opts.on_conflict = logifix::conflict_policy::drop_patch;
+        } else if (str == "skip-file") {
+            opts.on_conflict = logifix::conflict_policy::skip_file;
+        } else {
+            fmt::print("Error: Found invalid conflict action '{}'\n\n", str);
+            print_usage();
+            print_flags();
+            std::exit(1);
+        }
+    };
+
     flags = {
         {"--accept-all", [&](const std::string& str) { opts.accept_all = true; },
          "Accept all patches without asking"},
@@ -337,6 +287,34 @@ auto parse_options(int argc, char** argv) -> options {
          "Print graphviz representation of rewrite graph to stdout and exit"},
         {"--print-json", [&](const std::string& str) { opts.print_json = true; },
          "Print json data to stdout and exit"},
+        {"--count", [&](const std::string& str) { opts.count = true; },
+         "Print the number of findings of each rule in each file and exit"},
+        {"--report", [&](const std::string& str) { opts.report = true; },
+         "Print the range and rule of each finding and exit"},
+        {"--timeout=<seconds>",
+         [&](const std::string& str) { opts.timeout = std::stoul(str); },
+         "Skip files that take longer than this to analyze"},
+        {"--max-file-memory=<megabytes>",
+         [&](const std::string& str) { opts.max_file_memory = std::stoul(str); },
+         "Skip files whose rewrite graph grows larger than this"},
+        {"--jobs=<n>", [&](const std::string& str) { opts.jobs = std::stoul(str); },
+         "Use at most this many threads, defaults to the number of cores"},
+        {"--split-above=<kilobytes>",
+         [&](const std::string& str) { opts.split_above = std::stoul(str); },
+         "Analyze larger files in parallel chunks of methods"},
+        {"--cache=<directory>", [&](const std::string& str) { opts.cache = str; },
+         "Reuse analysis results of unchanged files, or chunks with --split-above"},
+        {"--on-conflict=<action>", [&](const std::string& str) { parse_on_conflict(str); },
+         "Handle merge conflicts with abort (default), drop-patch or skip-file"},
+        {"--conflict-report=<file>",
+         [&](const std::string& str) { opts.conflict_report = str; },
+         "Write merge conflicts as json to file"},
+        {"--profile=<file>", [&](const std::string& str) { opts.profile = str; },
+         "Write a Chrome trace of where time is spent to file"},
+        {"--profile-rules", [&](const std::string& str) { opts.profile_rules = true; },
+         "Print the cost of each relation, rule and file to stderr"},
+        {"--graph-stats=<file>", [&](const std::string& str) { opts.graph_stats = str; },
+         "Write rewrite graph statistics for each file as json to file"},
         {"--help",
          [&](const std::string& str) {
              print_usage();
@@ -480,146 +458,277 @@ auto multi_choice(const std::string& question, const std::vector<std::string>& a
     return 0;
 }
 
-auto post_process_remove_introduced_empty_lines(const std::string& before, const std::string& after)
-    -> std::string {
-    auto before_lines = utils::line_split(before);
-    auto after_lines = utils::line_split(after);
-    auto lcs = nway::lcs(after_lines, before_lines);
-    auto result = std::string{};
-    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
-        if (!lcs[i] && utils::string_has_only_whitespace(after_lines[i])) {
-            continue;
-        }
-        result += after_lines[i];
-    }
-    return result;
-}
-
-auto post_process_harmonize_line_terminators(const std::string& before, const std::string& after)
-    -> std::string {
-    auto line_terminator = utils::detect_line_terminator(before);
-    auto result = std::string{};
-    for (auto line : utils::line_split(after)) {
-        if (line_terminator == "\r\n") {
-            if (utils::ends_with(line, "\n") && !utils::ends_with(line, "\r\n")) {
-                line.pop_back();
-                line += "\r\n";
+auto get_results(const logifix::program& program,
+                 const std::set<logifix::patch_id>& accepted_patches,
+                 const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
+    -> std::map<std::string, std::string> {
+    auto results = std::map<std::string, std::string>{};
+    for (auto [id, filename] : filename_of_node) {
+        auto accepted_patches_for_file = std::vector<logifix::patch_id>{};
+        for (auto patch : program.get_patches_for_file(id)) {
+            if (accepted_patches.find(patch) != accepted_patches.end()) {
+                accepted_patches_for_file.emplace_back(patch);
             }
         }
-        result += line;
+        if (!accepted_patches_for_file.empty()) {
+            auto before = cli::read_file(filename);
+            auto after = program.get_result(id, accepted_patches_for_file);
+            auto span = timer::span("post_process", id, timer::NO_ID);
+            results.emplace(filename, post_process(before, after));
+        }
     }
-    return result;
+    return results;
 }
 
-auto post_process_auto_indent(const std::string& before, const std::string& after) -> std::string {
-    auto bracket_balance = [](const std::string& str) {
-        auto result = 0;
-        for (auto c : str) {
-            if (c == '(' || c == '{') {
-                result++;
-            } else if (c == ')' || c == '}') {
-                result--;
-            }
+/**
+ * Write the merge conflicts that were resolved during the run as a json
+ * array.
+ */
+auto write_conflict_report(const std::string& path, const logifix::program& program,
+                           const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
+    -> void {
+    auto quote_all = [](const std::vector<std::string>& strs) {
+        auto result = std::vector<std::string>{};
+        for (const auto& str : strs) {
+            result.emplace_back(fmt::format("\"{}\"", utils::json_escape(str)));
         }
         return result;
     };
-    auto before_lines = utils::line_split(before);
-    auto after_lines = utils::line_split(after);
-    auto lcs = nway::lcs(after_lines, before_lines);
-    auto indentation = utils::detect_indentation(before);
-    auto result = std::string{};
-    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
-        auto& line = after_lines[i];
-        if (i > 0 && !lcs[i] && utils::find_first_non_space(line) == line.begin()) {
-            auto prev_line = after_lines[i - 1];
-            // get indent from previous line
-            auto new_indent =
-                prev_line.substr(0, utils::find_first_non_space(prev_line) - prev_line.begin());
-            // increase indent if previous line has an open bracket
-            if (bracket_balance(prev_line) > 0) {
-                new_indent += indentation;
-            }
-            // decrease indent if we have closing bracket
-            if (bracket_balance(after_lines[i]) < 0) {
-                new_indent = new_indent.substr(std::min(indentation.size(), new_indent.size()));
-            }
-            line = new_indent + line;
-        }
-        result += line;
+    auto f = std::ofstream(path);
+    f << "[";
+    auto first = true;
+    for (const auto& conflict : program.get_merge_conflicts()) {
+        f << (first ? "\n" : ",\n");
+        first = false;
+        f << "    {\n";
+        f << fmt::format("        \"filename\": \"{}\",\n",
+                         utils::json_escape(filename_of_node.at(conflict.file)));
+        f << fmt::format("        \"fragment\": \"{}\",\n", utils::json_escape(conflict.fragment));
+        f << fmt::format("        \"rules\": [{}],\n", fmt::join(quote_all(conflict.rules), ", "));
+        f << fmt::format("        \"dropped\": [{}]\n",
+                         fmt::join(quote_all(conflict.dropped_rules), ", "));
+        f << "    }";
     }
-    return result;
+    f << (first ? "]\n" : "\n]\n");
 }
 
-auto post_process_sort_imports(const std::string& before, std::string after) -> std::string {
-    auto before_lines = utils::line_split(before);
-    auto after_lines = utils::line_split(after);
-    auto lcs = nway::lcs(after_lines, before_lines);
-    auto result = std::vector<std::string>{};
-    auto imports = std::vector<std::string>{};
-    auto other_imports = false;
-    auto last_import_at = std::size_t{};
-    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
-        if (!lcs[i] && utils::starts_with(after_lines[i], "import")) {
-            imports.emplace_back(after_lines[i]);
-        } else {
-            if (utils::starts_with(after_lines[i], "import")) {
-                other_imports = true;
-                last_import_at = i - imports.size();
+/**
+ * Print the aggregated cost of the Datalog analysis and the files that took
+ * the longest to analyze.
+ */
+auto print_rule_profile(const logifix::program& program,
+                        const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
+    -> void {
+    constexpr auto MAX_FILES_SHOWN = std::size_t{10};
+    const auto& profile = program.get_rule_profile();
+    auto by_count = [](const auto& a, const auto& b) { return a.second > b.second; };
+
+    auto relations = std::vector<std::pair<std::string, size_t>>(profile.relation_sizes.begin(),
+                                                                 profile.relation_sizes.end());
+    std::stable_sort(relations.begin(), relations.end(), by_count);
+    fmt::print(stderr, fmt::emphasis::bold, "\n\n{:<50} {:>14} {:>14}\n", "Relation", "Tuples",
+               "Tuples/run");
+    for (const auto& [relation, tuples] : relations) {
+        fmt::print(stderr, "{:<50} {:>14} {:>14.1f}\n", relation, tuples,
+                   double(tuples) / double(std::max(profile.runs, size_t{1})));
+    }
+
+    auto rules = std::vector<std::pair<std::string, size_t>>(profile.rewrites_per_rule.begin(),
+                                                             profile.rewrites_per_rule.end());
+    std::stable_sort(rules.begin(), rules.end(), by_count);
+    fmt::print(stderr, fmt::emphasis::bold, "\n{:<50} {:>14}\n", "Rule", "Rewrites");
+    for (const auto& [rule, rewrites] : rules) {
+        fmt::print(stderr, "{:<50} {:>14}\n", rule, rewrites);
+    }
+
+    auto files = std::vector<std::pair<logifix::node_id, double>>{};
+    for (const auto& [file, time] : profile.time_per_file) {
+        files.emplace_back(file, std::chrono::duration<double>(time).count());
+    }
+    std::sort(files.begin(), files.end(), by_count);
+    files.resize(std::min(files.size(), MAX_FILES_SHOWN));
+    fmt::print(stderr, fmt::emphasis::bold, "\n{:<50} {:>14}\n", "File", "Seconds");
+    for (const auto& [file, seconds] : files) {
+        fmt::print(stderr, "{:<50} {:>14.3f}\n", filename_of_node.at(file), seconds);
+    }
+    fmt::print(stderr, "\n{} Soufflé runs\n", profile.runs);
+}
+
+/**
+ * Label of the power of two bucket that a value belongs to, such as 4-7.
+ */
+auto histogram_bucket(size_t value) -> std::string {
+    if (value < 2) {
+        return std::to_string(value);
+    }
+    auto low = size_t{1};
+    while (low * 2 <= value) {
+        low *= 2;
+    }
+    return fmt::format("{}-{}", low, low * 2 - 1);
+}
+
+/**
+ * Write the size of the rewrite graph of each file as json, followed by
+ * histograms over all files.
+ */
+auto write_graph_statistics(const std::string& path, const logifix::program& program,
+                            const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
+    -> void {
+    auto files = std::map<std::string, logifix::node_id>{};
+    for (const auto& [node_id, filename] : filename_of_node) {
+        files.emplace(filename, node_id);
+    }
+    auto histograms = std::map<std::string, std::map<size_t, size_t>>{};
+    auto f = std::ofstream(path);
+    f << "{\n    \"files\": [";
+    auto first = true;
+    for (const auto& [filename, node_id] : files) {
+        auto stats = program.get_graph_statistics(node_id);
+        auto fan_out = std::vector<std::string>{};
+        for (const auto& [rule, children] : stats.children_per_rule) {
+            fan_out.emplace_back(fmt::format("\"{}\": {}", utils::json_escape(rule), children));
+        }
+        f << (first ? "\n" : ",\n");
+        first = false;
+        f << fmt::format("        {{\"filename\": \"{}\", \"nodes\": {}, \"merge_nodes\": {}, "
+                         "\"max_depth\": {}, \"deduplicated\": {}, \"source_bytes\": {}, "
+                         "\"children_per_rule\": {{{}}}}}",
+                         utils::json_escape(filename), stats.nodes, stats.merge_nodes,
+                         stats.max_depth, stats.deduplicated, stats.source_bytes,
+                         fmt::join(fan_out, ", "));
+        histograms["nodes"][stats.nodes]++;
+        histograms["merge_nodes"][stats.merge_nodes]++;
+        histograms["max_depth"][stats.max_depth]++;
+        histograms["deduplicated"][stats.deduplicated]++;
+        histograms["source_bytes"][stats.source_bytes]++;
+    }
+    f << "\n    ],\n    \"histograms\": {";
+    first = true;
+    for (const auto& [name, counts] : histograms) {
+        /* values are ordered, so equal buckets are adjacent */
+        auto buckets = std::vector<std::pair<std::string, size_t>>{};
+        for (const auto& [value, count] : counts) {
+            auto bucket = histogram_bucket(value);
+            if (buckets.empty() || buckets.back().first != bucket) {
+                buckets.emplace_back(bucket, 0);
             }
-            result.emplace_back(after_lines[i]);
+            buckets.back().second += count;
+        }
+        auto entries = std::vector<std::string>{};
+        for (const auto& [bucket, count] : buckets) {
+            entries.emplace_back(fmt::format("\"{}\": {}", bucket, count));
         }
+        f << (first ? "\n" : ",\n");
+        first = false;
+        f << fmt::format("        \"{}\": {{{}}}", name, fmt::join(entries, ", "));
     }
-    if (!other_imports) {
-        return after;
+    f << "\n    }\n}\n";
+}
+
+/**
+ * Print where the worker threads spent their time, and how many of them
+ * were idle over the course of the run.
+ */
+auto print_thread_statistics(const logifix::program& program) -> void {
+    constexpr auto TIMELINE_SLICES = std::size_t{10};
+    using seconds = std::chrono::duration<double>;
+    const auto& stats = program.get_thread_statistics();
+    auto wall_time = seconds(stats.wall_time).count();
+    auto thread_time = wall_time * double(stats.threads);
+    if (thread_time <= 0) {
+        return;
     }
-    std::sort(imports.begin(), imports.end());
-    for (const auto& import : imports) {
-        for (auto i = std::size_t{}; i < result.size(); i++) {
-            if (utils::starts_with(result[i], "import") && import < result[i]) {
-                result.insert(result.begin() + i, import);
-                break;
-            }
-            if (i > 0 && utils::starts_with(result[i - 1], "import") &&
-                !utils::starts_with(result[i], "import") && import > result[i]) {
-                result.insert(result.begin() + i, import);
-                break;
+    auto print_share = [thread_time](const std::string& name, auto duration) {
+        auto time = seconds(duration).count();
+        fmt::print(stderr, "{:<30} {:>10.3f}s {:>6.1f}%\n", name, time, 100 * time / thread_time);
+    };
+    fmt::print(stderr, fmt::emphasis::bold, "\n\n{} threads, {:.3f}s wall time\n",
+               stats.threads, wall_time);
+    print_share("Waiting for the work mutex", stats.lock_wait);
+    print_share("Waiting for work", stats.condition_wait);
+    print_share("Analysis", stats.analysis);
+    print_share("  Running Soufflé", stats.souffle);
+
+    /* the number of idle workers is constant between two samples */
+    auto idle_time_between = [&stats, wall_time](double from, double to) {
+        auto result = 0.0;
+        for (auto i = std::size_t{}; i < stats.idle_workers.size(); i++) {
+            auto start = seconds(stats.idle_workers[i].first).count();
+            auto end = i + 1 < stats.idle_workers.size()
+                           ? seconds(stats.idle_workers[i + 1].first).count()
+                           : wall_time;
+            auto overlap = std::min(end, to) - std::max(start, from);
+            if (overlap > 0) {
+                result += overlap * double(stats.idle_workers[i].second);
             }
         }
+        return result;
+    };
+    fmt::print(stderr, "{:<30} {:>11.1f}\n", "Average idle workers",
+               idle_time_between(0, wall_time) / wall_time);
+    auto timeline = std::vector<std::string>{};
+    for (auto i = std::size_t{}; i < TIMELINE_SLICES; i++) {
+        auto from = wall_time * double(i) / TIMELINE_SLICES;
+        auto to = wall_time * double(i + 1) / TIMELINE_SLICES;
+        timeline.emplace_back(fmt::format("{:.1f}", idle_time_between(from, to) / (to - from)));
     }
-    std::string result_str;
-    for (const auto& x : result) {
-        result_str += x;
-    }
-    return result_str;
+    fmt::print(stderr, "{:<30} {}\n", "Idle workers over time", fmt::join(timeline, " "));
 }
 
-auto post_process(const std::string& before, std::string after) -> std::string {
-    after = post_process_harmonize_line_terminators(before, after);
-    after = post_process_auto_indent(before, after);
-    after = post_process_sort_imports(before, after);
-    after = post_process_remove_introduced_empty_lines(before, after);
-    return after;
+/**
+ * Print the files whose rewrite graphs hold the most memory, and the
+ * resident set size of the process after their Soufflé runs.
+ */
+auto print_memory_statistics(
+    const logifix::program& program,
+    const std::unordered_map<logifix::node_id, std::string>& filename_of_node) -> void {
+    constexpr auto MAX_FILES_SHOWN = std::size_t{10};
+    constexpr auto MEGABYTE = 1024.0 * 1024.0;
+    auto statistics = program.get_memory_statistics();
+    auto files = std::vector<std::pair<logifix::node_id, logifix::memory_statistics>>(
+        statistics.begin(), statistics.end());
+    std::sort(files.begin(), files.end(), [](const auto& a, const auto& b) {
+        return std::tie(a.second.graph_bytes, a.second.peak_rss_growth) >
+               std::tie(b.second.graph_bytes, b.second.peak_rss_growth);
+    });
+    auto peak_rss = std::size_t{};
+    for (const auto& [file, memory] : files) {
+        peak_rss = std::max(peak_rss, memory.peak_rss);
+    }
+    files.resize(std::min(files.size(), MAX_FILES_SHOWN));
+    fmt::print(stderr, fmt::emphasis::bold, "\n\n{:<50} {:>10} {:>10} {:>10}\n", "File",
+               "Graph MB", "RSS MB", "Growth MB");
+    for (const auto& [file, memory] : files) {
+        fmt::print(stderr, "{:<50} {:>10.1f} {:>10.1f} {:>10.1f}\n", filename_of_node.at(file),
+                   double(memory.graph_bytes) / MEGABYTE, double(memory.peak_rss) / MEGABYTE,
+                   double(memory.peak_rss_growth) / MEGABYTE);
+    }
+    fmt::print(stderr, "{:<50} {:>21.1f}\n", "Peak resident set size after Soufflé",
+               double(peak_rss) / MEGABYTE);
 }
 
-auto get_results(const logifix::program& program,
-                 const std::set<logifix::patch_id>& accepted_patches,
-                 const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
-    -> std::map<std::string, std::string> {
-    auto results = std::map<std::string, std::string>{};
-    for (auto [id, filename] : filename_of_node) {
-        auto accepted_patches_for_file = std::vector<logifix::patch_id>{};
-        for (auto patch : program.get_patches_for_file(id)) {
-            if (accepted_patches.find(patch) != accepted_patches.end()) {
-                accepted_patches_for_file.emplace_back(patch);
-            }
-        }
-        if (!accepted_patches_for_file.empty()) {
-            auto before = cli::read_file(filename);
-            auto after = program.get_result(id, accepted_patches_for_file);
-            results.emplace(filename, post_process(before, after));
+/**
+ * Print one line per finding with the line and column where it starts and
+ * where it ends. The end is the position right after the rewritten code.
+ */
+auto print_findings(const std::string& filename, const std::string& source,
+                    const logifix::finding_collection& findings) -> void {
+    auto line_starts = std::vector<std::size_t>{0};
+    for (auto pos = std::size_t{}; pos < source.size(); pos++) {
+        if (source[pos] == '\n') {
+            line_starts.emplace_back(pos + 1);
         }
     }
-    return results;
+    auto position = [&line_starts](std::size_t offset) {
+        auto line = std::upper_bound(line_starts.begin(), line_starts.end(), offset) - 1;
+        return fmt::format("{}:{}", line - line_starts.begin() + 1, offset - *line + 1);
+    };
+    for (const auto& [rule, rewrite] : findings) {
+        const auto& [start, end, replacement] = rewrite;
+        fmt::print("{}:{}-{}: {}\n", filename, position(start), position(end), rule);
+    }
+    std::fflush(stdout);
 }
 
 } // namespace cli
@@ -649,11 +758,24 @@ auto main(int argc, char** argv) -> int {
 
     auto filename_of_node = std::unordered_map<logifix::node_id, std::string>{};
 
+    if (!options.profile.empty()) {
+        timer::enable();
+    }
+
     for (const auto& file : options.files) {
+        auto span = timer::span("read");
         auto node_id = program.add_file(cli::read_file(file));
+        span.set_file(node_id);
         filename_of_node[node_id] = file;
     }
 
+    for (const auto& [rule, data] : rule_data) {
+        program.set_rule_triggers(rule, std::get<4>(data));
+        if (std::get<5>(data)) {
+            program.add_file_level_rule(rule);
+        }
+    }
+
     if (!options.enable_all) {
         for (const auto& [rule, data] : rule_data) {
             if (std::get<3>(data)) {
@@ -662,26 +784,161 @@ auto main(int argc, char** argv) -> int {
         }
     }
 
-    auto count = std::size_t{};
+    if (options.timeout > 0) {
+        program.set_timeout(std::chrono::seconds(options.timeout));
+    }
 
-    program.run([&count, &options](size_t node) {
-        count++;
-        auto progress = int((double(count) / double(options.files.size())) * 40);
-        auto progress_full = 40;
-        fmt::print(stderr, "\r[{2:=^{0}}{2: ^{1}}] {3}/{4}", progress, progress_full - progress, "",
-                   count, options.files.size());
-    });
+    if (options.max_file_memory > 0) {
+        program.set_memory_limit(options.max_file_memory * 1024 * 1024);
+    }
+
+    if (options.jobs > 0) {
+        program.set_jobs(options.jobs);
+    }
+
+    program.set_split_threshold(options.split_above * 1024);
+
+    if (!options.cache.empty()) {
+        std::filesystem::create_directories(options.cache);
+        program.set_cache_directory(options.cache);
+    }
+
+    program.set_conflict_policy(options.on_conflict);
+
+    if (options.profile_rules) {
+        program.enable_rule_profiling();
+    }
+
+    /* in lazy mode the graph below a patch is explored when the patch is
+     * reviewed, and review starts while the files are being analyzed. Graph
+     * statistics need the whole graph, so they are analyzed up front. */
+    auto interactive = !options.patch && !options.in_place && !options.print_graphviz &&
+                       !options.print_json && !options.count && !options.report;
+    auto lazy = interactive && options.graph_stats.empty();
+    if (lazy) {
+        program.enable_lazy_mode();
+    }
 
-    // logifix::print_performance_metrics();
+    /* in scan mode findings are printed as soon as a file is done */
+    auto findings_mutex = std::mutex{};
+    auto findings_per_file = std::map<std::string, std::map<logifix::rule_id, size_t>>{};
+    if (options.count || options.report) {
+        program.enable_scan_mode([&](logifix::node_id file, const std::string& source,
+                                     const logifix::finding_collection& findings) {
+            auto lock = std::unique_lock{findings_mutex};
+            const auto& filename = filename_of_node.at(file);
+            if (options.report) {
+                cli::print_findings(filename, source, findings);
+            }
+            for (const auto& [rule, rewrite] : findings) {
+                findings_per_file[filename][rule]++;
+            }
+        });
+    }
+
+    /* stopped once the run is done or review has started */
+    auto progress = cli::progress_reporter(program, filename_of_node);
+
+    auto print_run_summary = [&options, &program, &filename_of_node]() {
+        auto timed_out_files = program.get_timed_out_files();
+        if (!timed_out_files.empty()) {
+            fmt::print(stderr, fg(fmt::terminal_color::yellow), "\n\nWarning: ");
+            fmt::print(stderr, "Skipped {} files that timed out\n", timed_out_files.size());
+            for (auto node_id : timed_out_files) {
+                fmt::print(stderr, "    {}\n", filename_of_node[node_id]);
+            }
+        }
+
+        auto memory_limited_files = program.get_memory_limited_files();
+        if (!memory_limited_files.empty()) {
+            fmt::print(stderr, fg(fmt::terminal_color::yellow), "\n\nWarning: ");
+            fmt::print(stderr, "Skipped {} files that exceeded the memory limit\n",
+                       memory_limited_files.size());
+            for (auto node_id : memory_limited_files) {
+                fmt::print(stderr, "    {}\n", filename_of_node[node_id]);
+            }
+        }
+
+        if (options.verbose) {
+            cli::print_thread_statistics(program);
+            cli::print_memory_statistics(program, filename_of_node);
+        }
+
+        if (options.profile_rules) {
+            cli::print_rule_profile(program, filename_of_node);
+        }
+
+        if (!options.graph_stats.empty()) {
+            cli::write_graph_statistics(options.graph_stats, program, filename_of_node);
+        }
+
+        auto conflicted_files = program.get_conflicted_files();
+        if (!conflicted_files.empty()) {
+            fmt::print(stderr, fg(fmt::terminal_color::yellow), "\n\nWarning: ");
+            fmt::print(stderr, "Skipped {} files with merge conflicts\n", conflicted_files.size());
+            for (auto node_id : conflicted_files) {
+                fmt::print(stderr, "    {}\n", filename_of_node[node_id]);
+            }
+        }
+
+        // logifix::print_performance_metrics();
+    };
+
+    /* in lazy mode the files are analyzed in the background, and the
+     * analysis must be finished before the indexes of the program are read */
+    auto analysis = std::thread{};
+    auto finish_analysis = [&analysis, &options, &program, &print_run_summary](bool cancel) {
+        if (!analysis.joinable()) {
+            return;
+        }
+        if (cancel) {
+            program.cancel_pending_files();
+        } else if (program.count_analyzed_files() < options.files.size()) {
+            fmt::print(stderr, "\nWaiting for the analysis to finish...\n");
+        }
+        program.set_serving(false);
+        analysis.join();
+        print_run_summary();
+    };
+
+    if (lazy) {
+        program.set_serving(true);
+        analysis = std::thread([&program]() { program.run(); });
+    } else {
+        program.run();
+        progress.stop();
+        print_run_summary();
+    }
+
+    if (options.count) {
+        for (const auto& [filename, counts] : findings_per_file) {
+            for (const auto& [rule, count] : counts) {
+                fmt::print("{}: {}: {}\n", filename, rule, count);
+            }
+        }
+    }
+
+    if (options.count || options.report) {
+        return 0;
+    }
 
     auto review = [&options, &accepted_patches, &filename_of_node,
                    &program](logifix::patch_id patch, size_t curr, size_t total) {
         // auto& [filename, rule, after, accepted] = rw;
+        program.expand({patch});
+        if (!program.has_patch(patch)) {
+            /* the file timed out or conflicted while exploring the patch */
+            return true;
+        }
         auto [rule, node_id, after] = program.get_patch_data(patch);
         auto filename = filename_of_node[node_id];
         fmt::print(fmt::emphasis::bold, "\nPatch {}/{} • {}\n\n", curr, total, filename);
         auto before = cli::read_file(filename);
-        auto diff = cli::create_patch(filename, before, cli::post_process(before, after));
+        auto diff = std::vector<std::string>{};
+        {
+            auto span = timer::span("post_process", node_id, patch);
+            diff = cli::create_patch(filename, before, cli::post_process(before, after));
+        }
         if (!diff.empty()) {
             for (const auto& line : cli::prettify_patch(diff)) {
                 std::cout << line << std::endl;
@@ -720,15 +977,50 @@ auto main(int argc, char** argv) -> int {
         return 0;
     }
 
-    if (!options.patch && !options.in_place) {
+    if (interactive) {
 
+        /* patches of analyzed files, in the order the files were finished */
+        auto ready_patches = std::map<logifix::rule_id, std::vector<logifix::patch_id>>{};
+        auto ready_count = std::size_t{};
+        auto collect_ready_patches = [&]() {
+            for (const auto& [rule, patch] : program.take_published_patches()) {
+                ready_patches[rule].emplace_back(patch);
+                ready_count++;
+            }
+        };
+        if (!lazy) {
+            for (const auto& [rule, data] : rule_data) {
+                for (auto patch : program.get_patches_for_rule(rule)) {
+                    ready_patches[rule].emplace_back(patch);
+                    ready_count++;
+                }
+            }
+        }
+        auto analysis_done = [&]() {
+            return program.count_analyzed_files() == options.files.size();
+        };
+
+        /* wait for the first patches */
+        program.wait_for_published_patches();
+        collect_ready_patches();
+        progress.stop();
+
+        /* the files that have not been analyzed are dropped when exiting
+         * without applying the changes */
+        auto cancel = false;
         while (true) {
 
             auto selection = 0;
+            collect_ready_patches();
+            auto status =
+                analysis_done()
+                    ? fmt::format("Analyzed {} files", options.files.size())
+                    : fmt::format("Analyzed {}/{} files", program.count_analyzed_files(),
+                                  options.files.size());
 
             if (!accepted_patches.empty()) {
-                fmt::print(fmt::emphasis::bold, "\nSelected {}/{} patches\n\n",
-                           accepted_patches.size(), program.get_all_patches().size());
+                fmt::print(fmt::emphasis::bold, "\n{}, selected {}/{} patches\n\n", status,
+                           accepted_patches.size(), ready_count);
                 selection = cli::multi_choice("What would you like to do?",
                                               {
                                                   "Review patches by rule",
@@ -738,6 +1030,7 @@ auto main(int argc, char** argv) -> int {
                                               });
 
                 if (selection == 1) {
+                    finish_analysis(false);
                     auto* fp = popen("less -R", "w");
                     if (fp != nullptr) {
                         for (auto [filename, after] :
@@ -758,13 +1051,14 @@ auto main(int argc, char** argv) -> int {
                     break;
                 }
                 if (selection == 3) {
+                    cancel = true;
                     break;
                 }
             } else {
-                fmt::print(fmt::emphasis::bold, "\n\nAnalyzed {} files and found {} patches\n\n",
-                           options.files.size(), program.get_all_patches().size());
+                fmt::print(fmt::emphasis::bold, "\n\n{} and found {} patches\n\n", status,
+                           ready_count);
 
-                if (program.get_all_patches().empty()) {
+                if (ready_count == 0 && analysis_done()) {
                     break;
                 }
 
@@ -774,16 +1068,18 @@ auto main(int argc, char** argv) -> int {
                                                   "Exit without doing anything",
                                               });
                 if (selection == 1) {
+                    cancel = true;
                     break;
                 }
             }
 
             while (true) {
                 if (selection == 0) {
+                    collect_ready_patches();
                     auto columns = std::vector<std::tuple<std::string, std::string, std::string>>{};
-                    for (auto [rule, data] : rule_data) {
-                        auto [sqid, pmdid, description, disabled] = data;
-                        auto patches = program.get_patches_for_rule(rule);
+                    for (const auto& [rule, data] : rule_data) {
+                        auto [sqid, pmdid, description, disabled, triggers, file_level] = data;
+                        const auto& patches = ready_patches[rule];
                         if (patches.empty()) {
                             continue;
                         }
@@ -819,7 +1115,8 @@ auto main(int argc, char** argv) -> int {
                         break;
                     }
                     auto rule = std::get<0>(columns[rule_selection]);
-                    auto patches = program.get_patches_for_rule(rule);
+                    /* a copy, more patches may be collected while reviewing */
+                    auto patches = ready_patches[rule];
                     for (auto i = std::size_t{}; i < patches.size(); i++) {
                         if (!review(patches[i], i + 1, patches.size())) {
                             break;
@@ -831,9 +1128,11 @@ auto main(int argc, char** argv) -> int {
             }
         }
 
+        finish_analysis(cancel);
+
     } else {
         if (options.accept_all) {
-            for (auto [rule, data] : rule_data) {
+            for (const auto& [rule, data] : rule_data) {
                 if (options.not_accepted.find(rule) == options.not_accepted.end()) {
                   for (auto patch : program.get_patches_for_rule(rule)) {
                       accepted_patches.insert(patch);
@@ -849,7 +1148,13 @@ auto main(int argc, char** argv) -> int {
         }
     }
 
+    auto node_of_filename = std::unordered_map<std::string, logifix::node_id>{};
+    for (const auto& [node_id, filename] : filename_of_node) {
+        node_of_filename[filename] = node_id;
+    }
+
     for (auto [filename, after] : cli::get_results(program, accepted_patches, filename_of_node)) {
+        auto span = timer::span("write", node_of_filename[filename], timer::NO_ID);
         if (options.in_place) {
             auto f = std::ofstream(filename);
             f << after;
@@ -863,5 +1168,18 @@ auto main(int argc, char** argv) -> int {
         }
     }
 
+    if (!program.get_merge_conflicts().empty()) {
+        fmt::print(stderr, fg(fmt::terminal_color::yellow), "\nWarning: ");
+        fmt::print(stderr, "Resolved {} merge conflicts\n", program.get_merge_conflicts().size());
+    }
+
+    if (!options.conflict_report.empty()) {
+        cli::write_conflict_report(options.conflict_report, program, filename_of_node);
+    }
+
+    if (!options.profile.empty()) {
+        timer::write_chrome_trace(options.profile, filename_of_node);
+    }
+
     return 0;
 }
@@ -0,0 +1,225 @@
+#include "patch.h"
+#include "utils.h"
+#include <algorithm>
+#include <fmt/core.h>
+#include <nway.h>
+#include <tuple>
+
+namespace cli {
+
+auto create_patch(const std::string& filename, const std::string& before, const std::string& after)
+    -> std::vector<std::string> {
+    constexpr auto LINES_OF_CONTEXT = std::size_t{3};
+    auto a = utils::line_split(before);
+    auto b = utils::line_split(after);
+    for (auto& x : a) {
+        x = utils::rtrim(x);
+    }
+    for (auto& x : b) {
+        x = utils::rtrim(x);
+    }
+    auto changes = std::vector<std::tuple<bool, char, std::string>>{};
+    auto lcs = nway::lcs(a, b);
+    auto a_pos = std::size_t{};
+    auto b_pos = std::size_t{};
+    while (a_pos < a.size() || b_pos < b.size()) {
+        /* a and b agree */
+        while (a_pos < a.size() && lcs[a_pos] && *lcs[a_pos] == b_pos) {
+            changes.emplace_back(false, ' ', a[a_pos]);
+            a_pos++;
+            b_pos++;
+        }
+        /* a has no matching position */
+        while (a_pos < a.size() && !lcs[a_pos]) {
+            changes.emplace_back(false, '-', a[a_pos]);
+            a_pos++;
+        }
+        /* a has matching position but it is not that of b_pos */
+        while (a_pos < a.size() && lcs[a_pos] && *lcs[a_pos] != b_pos) {
+            changes.emplace_back(false, '+', b[b_pos]);
+            b_pos++;
+        }
+    }
+    /* 3 lines of context */
+    for (auto i = 0; i < changes.size(); i++) {
+        auto& [keep, marker, line] = changes[i];
+        auto start = std::max(0, i - int(LINES_OF_CONTEXT));
+        auto stop = std::min(int(changes.size()), i + int(LINES_OF_CONTEXT) + 1);
+        for (auto j = start; j < stop; j++) {
+            if (std::get<1>(changes[j]) != ' ') {
+                keep = true;
+            }
+        }
+    }
+    /* create patch output */
+    auto result = std::vector<std::string>{};
+    result.emplace_back(fmt::format("diff --git a/{} b/{}", filename, filename));
+    auto a_pos_output = std::size_t{1};
+    auto b_pos_output = std::size_t{1};
+    for (auto i = std::size_t{}; i < changes.size(); i++) {
+        auto& [keep, marker, line] = changes[i];
+        if (!keep) {
+            a_pos_output++;
+            b_pos_output++;
+            continue;
+        }
+        auto a_start = a_pos_output;
+        auto b_start = b_pos_output;
+        auto a_lines = std::size_t{};
+        auto b_lines = std::size_t{};
+        auto hunk_end = i;
+        while (hunk_end < changes.size() && std::get<0>(changes[hunk_end])) {
+            switch (std::get<1>(changes[hunk_end])) {
+            case ' ':
+                a_pos_output++;
+                b_pos_output++;
+                a_lines++;
+                b_lines++;
+                break;
+            case '-':
+                a_pos_output++;
+                a_lines++;
+                break;
+            case '+':
+                b_pos_output++;
+                b_lines++;
+                break;
+            default:
+                break;
+            }
+            hunk_end++;
+        }
+        /* output header */
+        result.emplace_back(fmt::format("@@ -{},{} +{},{} @@", a_start, a_lines, b_start, b_lines));
+        while (i < changes.size() && std::get<0>(changes[i])) {
+            result.emplace_back(
+                fmt::format("{}{}", std::get<1>(changes[i]), std::get<2>(changes[i])));
+            i++;
+        }
+        i--;
+    }
+    return result;
+}
+
+auto post_process_remove_introduced_empty_lines(const std::string& before, const std::string& after)
+    -> std::string {
+    auto before_lines = utils::line_split(before);
+    auto after_lines = utils::line_split(after);
+    auto lcs = nway::lcs(after_lines, before_lines);
+    auto result = std::string{};
+    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
+        if (!lcs[i] && utils::string_has_only_whitespace(after_lines[i])) {
+            continue;
+        }
+        result += after_lines[i];
+    }
+    return result;
+}
+
+auto post_process_harmonize_line_terminators(const std::string& before, const std::string& after)
+    -> std::string {
+    auto line_terminator = utils::detect_line_terminator(before);
+    auto result = std::string{};
+    for (auto line : utils::line_split(after)) {
+        if (line_terminator == "\r\n") {
+            if (utils::ends_with(line, "\n") && !utils::ends_with(line, "\r\n")) {
+                line.pop_back();
+                line += "\r\n";
+            }
+        }
+        result += line;
+    }
+    return result;
+}
+
+auto post_process_auto_indent(const std::string& before, const std::string& after) -> std::string {
+    auto bracket_balance = [](const std::string& str) {
+        auto result = 0;
+        for (auto c : str) {
+            if (c == '(' || c == '{') {
+                result++;
+            } else if (c == ')' || c == '}') {
+                result--;
+            }
+        }
+        return result;
+    };
+    auto before_lines = utils::line_split(before);
+    auto after_lines = utils::line_split(after);
+    auto lcs = nway::lcs(after_lines, before_lines);
+    auto indentation = utils::detect_indentation(before);
+    auto result = std::string{};
+    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
+        auto& line = after_lines[i];
+        if (i > 0 && !lcs[i] && utils::find_first_non_space(line) == line.begin()) {
+            auto prev_line = after_lines[i - 1];
+            // get indent from previous line
+            auto new_indent =
+                prev_line.substr(0, utils::find_first_non_space(prev_line) - prev_line.begin());
+            // increase indent if previous line has an open bracket
+            if (bracket_balance(prev_line) > 0) {
+                new_indent += indentation;
+            }
+            // decrease indent if we have closing bracket
+            if (bracket_balance(after_lines[i]) < 0) {
+                new_indent = new_indent.substr(std::min(indentation.size(), new_indent.size()));
+            }
+            line = new_indent + line;
+        }
+        result += line;
+    }
+    return result;
+}
+
+auto post_process_sort_imports(const std::string& before, std::string after) -> std::string {
+    auto before_lines = utils::line_split(before);
+    auto after_lines = utils::line_split(after);
+    auto lcs = nway::lcs(after_lines, before_lines);
+    auto result = std::vector<std::string>{};
+    auto imports = std::vector<std::string>{};
+    auto other_imports = false;
+    auto last_import_at = std::size_t{};
+    for (auto i = std::size_t{}; i < after_lines.size(); i++) {
+        if (!lcs[i] && utils::starts_with(after_lines[i], "import")) {
+            imports.emplace_back(after_lines[i]);
+        } else {
+            if (utils::starts_with(after_lines[i], "import")) {
+                other_imports = true;
+                last_import_at = i - imports.size();
+            }
+            result.emplace_back(after_lines[i]);
+        }
+    }
+    if (!other_imports) {
+        return after;
+    }
+    std::sort(imports.begin(), imports.end());
+    for (const auto& import : imports) {
+        for (auto i = std::size_t{}; i < result.size(); i++) {
+            if (utils::starts_with(result[i], "import") && import < result[i]) {
+                result.insert(result.begin() + i, import);
+                break;
+            }
+            if (i > 0 && utils::starts_with(result[i - 1], "import") &&
+                !utils::starts_with(result[i], "import") && import > result[i]) {
+                result.insert(result.begin() + i, import);
+                break;
+            }
+        }
+    }
+    std::string result_str;
+    for (const auto& x : result) {
+        result_str += x;
+    }
+    return result_str;
+}
+
+auto post_process(const std::string& before, std::string after) -> std::string {
+    after = post_process_harmonize_line_terminators(before, after);
+    after = post_process_auto_indent(before, after);
+    after = post_process_sort_imports(before, after);
+    after = post_process_remove_introduced_empty_lines(before, after);
+    return after;
+}
+
+} // namespace cli
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace cli {
+
+auto create_patch(const std::string& filename, const std::string& before, const std::string& after)
+    -> std::vector<std::string>;
+
+/**
+ * Passes that make the result of a rewrite look like the surrounding code.
+ */
+auto post_process_remove_introduced_empty_lines(const std::string& before, const std::string& after)
+    -> std::string;
+auto post_process_harmonize_line_terminators(const std::string& before, const std::string& after)
+    -> std::string;
+auto post_process_auto_indent(const std::string& before, const std::string& after) -> std::string;
+auto post_process_sort_imports(const std::string& before, std::string after) -> std::string;
+auto post_process(const std::string& before, std::string after) -> std::string;
+
+} // namespace cli
@@ -0,0 +1,92 @@
+#include "progress.h"
+#include <cstdio>
+#include <fmt/core.h>
+#include <unistd.h>
+
+namespace {
+
+constexpr auto REPORT_INTERVAL = std::chrono::milliseconds(250);
+constexpr auto BAR_WIDTH = 30;
+const auto TTY_CLEAR_TO_EOL = std::string{"\033[K"};
+
+auto format_duration(double seconds) -> std::string {
+    auto total = static_cast<long>(seconds);
+    if (total < 60) {
+        return fmt::format("{}s", total);
+    }
+    if (total < 3600) {
+        return fmt::format("{}m{:02}s", total / 60, total % 60);
+    }
+    return fmt::format("{}h{:02}m", total / 3600, total % 3600 / 60);
+}
+
+} // namespace
+
+namespace cli {
+
+progress_reporter::progress_reporter(
+    const logifix::program& program,
+    const std::unordered_map<logifix::node_id, std::string>& filename_of_node)
+    : program(program), filename_of_node(filename_of_node),
+      start(std::chrono::steady_clock::now()) {
+    if (isatty(STDERR_FILENO) == 0) {
+        stopped = true;
+        return;
+    }
+    thread = std::thread([this]() {
+        auto lock = std::unique_lock{mutex};
+        while (!cv.wait_for(lock, REPORT_INTERVAL, [this]() { return stopped; })) {
+            print();
+        }
+    });
+}
+
+progress_reporter::~progress_reporter() { stop(); }
+
+/**
+ * Print the final progress and stop reporting. The cursor is left at the
+ * end of the line.
+ */
+auto progress_reporter::stop() -> void {
+    {
+        auto lock = std::unique_lock{mutex};
+        if (stopped) {
+            return;
+        }
+        stopped = true;
+    }
+    cv.notify_all();
+    thread.join();
+    print();
+}
+
+auto progress_reporter::print() const -> void {
+    auto progress = program.get_progress();
+    if (progress.files == 0) {
+        return;
+    }
+    auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    auto files_per_second = double(progress.finished_files) / seconds;
+    auto nodes_per_second = double(progress.analyzed_nodes) / seconds;
+    auto filled = int(double(progress.finished_files) / double(progress.files) * BAR_WIDTH);
+    auto line = fmt::format("\r[{2:=^{0}}{2: ^{1}}] {3}/{4} • {5:.1f} files/s • {6:.0f} nodes/s",
+                            filled, BAR_WIDTH - filled, "", progress.finished_files,
+                            progress.files, files_per_second, nodes_per_second);
+    if (progress.finished_files > 0 && progress.finished_files < progress.files) {
+        auto remaining = double(progress.files - progress.finished_files) / files_per_second;
+        line += fmt::format(" • ETA {}", format_duration(remaining));
+    }
+    if (progress.slowest_file) {
+        auto it = filename_of_node.find(*progress.slowest_file);
+        if (it != filename_of_node.end()) {
+            line += fmt::format(
+                " • slowest {} ({})", it->second,
+                format_duration(
+                    std::chrono::duration<double>(progress.slowest_file_time).count()));
+        }
+    }
+    fmt::print(stderr, "{}{}", line, TTY_CLEAR_TO_EOL);
+    std::fflush(stderr);
+}
+
+} // namespace cli
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "logifix.h"
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+namespace cli {
+
+/**
+ * Print the progress of a run to stderr a few times per second. Printing
+ * happens on a thread of its own, so the workers never wait for the
+ * terminal. Nothing is printed when stderr is not a terminal.
+ */
+class progress_reporter {
+  public:
+    progress_reporter(const logifix::program& program,
+                      const std::unordered_map<logifix::node_id, std::string>& filename_of_node);
+    progress_reporter(const progress_reporter&) = delete;
+    auto operator=(const progress_reporter&) -> progress_reporter& = delete;
+    ~progress_reporter();
+
+    auto stop() -> void;
+
+  private:
+    auto print() const -> void;
+
+    const logifix::program& program;
+    const std::unordered_map<logifix::node_id, std::string>& filename_of_node;
+    std::chrono::steady_clock::time_point start;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::thread thread;
+};
+
+} // namespace cli
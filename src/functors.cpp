@@ -1,5 +1,106 @@
+#include "functors.h"
 #include "utils.h"
+#include <mutex>
+#include <shared_mutex>
 #include <souffle/SouffleInterface.h>
+#include <unordered_map>
+
+namespace logifix::functors {
+
+namespace {
+std::shared_mutex programs_mutex;
+std::unordered_map<const souffle::SymbolTable*, program_state> programs;
+} // namespace
+
+auto register_program(const souffle::SymbolTable* symbol_table, std::string_view source) -> void {
+    auto lock = std::unique_lock{programs_mutex};
+    programs[symbol_table].source = source;
+}
+
+auto unregister_program(const souffle::SymbolTable* symbol_table) -> void {
+    auto lock = std::unique_lock{programs_mutex};
+    programs.erase(symbol_table);
+}
+
+/**
+ * Find the state of the program that owns the symbol table. The entry is
+ * never erased while the program is running, so the reference stays valid
+ * after the lock is released.
+ */
+auto get_program(const souffle::SymbolTable* symbol_table) -> program_state& {
+    auto lock = std::shared_lock{programs_mutex};
+    return programs.at(symbol_table);
+}
+
+/**
+ * Render a type record, e.g. Map<String, List<Integer>>, or with packages
+ * when qualified is set, e.g. java.util.Map<java.lang.String,java.lang.Integer>.
+ * The result is memoized by record id, the caller must hold the mutex of
+ * the program state.
+ */
+auto render_type(program_state& state, const souffle::SymbolTable* symbol_table,
+                 const souffle::RecordTable* record_table, souffle::RamDomain type, bool qualified)
+    -> const std::string& {
+    static const auto empty = std::string{};
+    if (type == 0) {
+        return empty;
+    }
+    auto& memo = qualified ? state.qualified_types : state.types;
+    if (auto it = memo.find(type); it != memo.end()) {
+        return it->second;
+    }
+    const auto* tuple = record_table->unpack(type, 3);
+    auto result = std::string{};
+    if (qualified) {
+        result += symbol_table->decode(tuple[0]);
+        result += ".";
+    }
+    result += symbol_table->decode(tuple[1]);
+    auto separator = qualified ? "," : ", ";
+    auto curr = tuple[2];
+    if (curr != 0) {
+        result += "<";
+        while (curr != 0) {
+            const auto* pair = record_table->unpack(curr, 2);
+            result += render_type(state, symbol_table, record_table, pair[0], qualified);
+            curr = pair[1];
+            if (curr != 0) {
+                result += separator;
+            }
+        }
+        result += ">";
+    }
+    return memo.emplace(type, std::move(result)).first->second;
+}
+
+/**
+ * Render a type argument list, e.g. <String, Integer>. The result is
+ * memoized by record id, the caller must hold the mutex of the program state.
+ */
+auto render_type_args(program_state& state, const souffle::SymbolTable* symbol_table,
+                      const souffle::RecordTable* record_table, souffle::RamDomain list)
+    -> const std::string& {
+    if (auto it = state.type_args.find(list); it != state.type_args.end()) {
+        return it->second;
+    }
+    auto result = std::string{};
+    auto curr = list;
+    if (curr != 0) {
+        result += "<";
+        while (curr != 0) {
+            const auto* pair = record_table->unpack(curr, 2);
+            result += render_type(state, symbol_table, record_table, pair[0], false);
+            curr = pair[1];
+            if (curr != 0) {
+                result += ", ";
+            }
+        }
+        result += ">";
+    }
+    return state.type_args.emplace(list, std::move(result)).first->second;
+}
+
+} // namespace logifix::functors
 
 extern "C" {
 souffle::RamDomain decrease_indentation(souffle::SymbolTable* symbolTable,
@@ -19,95 +120,53 @@ souffle::RamDomain decrease_indentation(souffle::SymbolTable* symbolTable,
     return symbolTable->encode(result);
 }
 
+/**
+ * Slice the source code of the calling program without going through the
+ * symbol table, only the resulting fragment is encoded.
+ */
+souffle::RamDomain source_substr(souffle::SymbolTable* symbolTable,
+                                 souffle::RecordTable* recordTable, souffle::RamDomain start,
+                                 souffle::RamDomain length) {
+    auto source = logifix::functors::get_program(symbolTable).source;
+    if (start < 0 || length < 0 || std::size_t(start) > source.size()) {
+        return symbolTable->encode("");
+    }
+    return symbolTable->encode(std::string(source.substr(start, length)));
+}
+
 souffle::RamDomain node_to_string(souffle::SymbolTable* symbolTable,
-                                  souffle::RecordTable* recordTable, souffle::RamDomain code,
-                                  souffle::RamDomain node) {
+                                  souffle::RecordTable* recordTable, souffle::RamDomain node) {
     if (node == 0) {
         return symbolTable->encode("");
     }
-    const auto& str = symbolTable->decode(code);
     const souffle::RamDomain* tuple = recordTable->unpack(node, 6);
     auto start = tuple[4];
     auto end = tuple[5];
-    return symbolTable->encode(str.substr(start, end - start));
+    return source_substr(symbolTable, recordTable, start, end - start);
 }
 
 souffle::RamDomain type_to_string(souffle::SymbolTable* symbolTable,
                                   souffle::RecordTable* recordTable, souffle::RamDomain arg) {
-    if (arg == 0) {
-        return symbolTable->encode("");
-    }
-    const souffle::RamDomain* tuple = recordTable->unpack(arg, 3);
-    const std::string& cl = symbolTable->decode(tuple[1]);
-    std::vector<std::string> type_args;
-    auto curr = tuple[2];
-    while (curr != 0) {
-        const auto* pair = recordTable->unpack(curr, 2);
-        type_args.emplace_back(
-            symbolTable->decode(type_to_string(symbolTable, recordTable, pair[0])));
-        curr = pair[1];
-    }
-    std::string result = cl;
-    if (!type_args.empty()) {
-        result += "<";
-        for (const auto& arg : type_args) {
-            result += arg + ", ";
-        }
-        result.pop_back();
-        result.pop_back();
-        result += ">";
-    }
-    return symbolTable->encode(result);
+    auto& state = logifix::functors::get_program(symbolTable);
+    auto lock = std::unique_lock{state.mutex};
+    return symbolTable->encode(
+        logifix::functors::render_type(state, symbolTable, recordTable, arg, false));
 }
 
 souffle::RamDomain type_args_to_string(souffle::SymbolTable* symbolTable,
                                        souffle::RecordTable* recordTable, souffle::RamDomain curr) {
-    std::vector<std::string> type_args;
-    while (curr != 0) {
-        const auto* pair = recordTable->unpack(curr, 2);
-        type_args.emplace_back(
-            symbolTable->decode(type_to_string(symbolTable, recordTable, pair[0])));
-        curr = pair[1];
-    }
-    std::string result;
-    if (!type_args.empty()) {
-        result += "<";
-        for (const auto& arg : type_args) {
-            result += arg + ", ";
-        }
-        result.pop_back();
-        result.pop_back();
-        result += ">";
-    }
-    return symbolTable->encode(result);
+    auto& state = logifix::functors::get_program(symbolTable);
+    auto lock = std::unique_lock{state.mutex};
+    return symbolTable->encode(
+        logifix::functors::render_type_args(state, symbolTable, recordTable, curr));
 }
 
 souffle::RamDomain type_to_qualified_string(souffle::SymbolTable* symbolTable,
                                             souffle::RecordTable* recordTable,
                                             souffle::RamDomain arg) {
-    if (arg == 0) {
-        return symbolTable->encode("");
-    }
-    const souffle::RamDomain* tuple = recordTable->unpack(arg, 3);
-    const std::string& package = symbolTable->decode(tuple[0]);
-    const std::string& cl = symbolTable->decode(tuple[1]);
-    std::vector<std::string> type_args;
-    auto curr = tuple[2];
-    while (curr != 0) {
-        const auto* pair = recordTable->unpack(curr, 2);
-        type_args.emplace_back(
-            symbolTable->decode(type_to_qualified_string(symbolTable, recordTable, pair[0])));
-        curr = pair[1];
-    }
-    std::string result = package + "." + cl;
-    if (!type_args.empty()) {
-        result += "<";
-        for (const auto& arg : type_args) {
-            result += arg + ",";
-        }
-        result.pop_back();
-        result += ">";
-    }
-    return symbolTable->encode(result);
+    auto& state = logifix::functors::get_program(symbolTable);
+    auto lock = std::unique_lock{state.mutex};
+    return symbolTable->encode(
+        logifix::functors::render_type(state, symbolTable, recordTable, arg, true));
 }
 }
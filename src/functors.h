@@ -0,0 +1,46 @@
+#pragma once
+
+#include <mutex>
+#include <souffle/SouffleInterface.h>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+
+namespace logifix::functors {
+
+/**
+ * Per-program state that is shared by the stateful functors. The functors
+ * only get access to the symbol and record tables of the program that calls
+ * them, so the state is looked up using the symbol table as the key.
+ */
+struct program_state {
+    std::string_view source;
+    /* guards the memoized type strings, functors may run in parallel */
+    std::mutex mutex;
+    std::unordered_map<souffle::RamDomain, std::string> types;
+    std::unordered_map<souffle::RamDomain, std::string> qualified_types;
+    std::unordered_map<souffle::RamDomain, std::string> type_args;
+};
+
+auto register_program(const souffle::SymbolTable*, std::string_view source) -> void;
+auto unregister_program(const souffle::SymbolTable*) -> void;
+
+/**
+ * Register the source code of a Soufflé program for the lifetime of this
+ * object.
+ */
+class scoped_program {
+  public:
+    scoped_program(const souffle::SymbolTable* symbol_table, std::string_view source)
+        : symbol_table(symbol_table) {
+        register_program(symbol_table, source);
+    }
+    scoped_program(const scoped_program&) = delete;
+    auto operator=(const scoped_program&) -> scoped_program& = delete;
+    ~scoped_program() { unregister_program(symbol_table); }
+
+  private:
+    const souffle::SymbolTable* symbol_table;
+};
+
+} // namespace logifix::functors
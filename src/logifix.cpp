@@ -1,19 +1,26 @@
 #include "logifix.h"
+#include "config.h"
+#include "functors.h"
 #include "javadoc.h"
 #include "timer.h"
 #include "utils.h"
+#include <atomic>
 #include <condition_variable>
+#include <cstdint>
 #include <cstdlib>
 #include <deque>
 #include <filesystem>
+#include <fstream>
 #include <fmt/color.h>
 #include <fmt/core.h>
 #include <iostream>
+#include <iterator>
 #include <mutex>
 #include <numeric>
 #include <nway.h>
 #include <regex>
 #include <thread>
+#include <unistd.h>
 #include <unordered_set>
 #include <utility>
 #include <vector>
@@ -31,25 +38,666 @@ template <typename T> auto segments_overlap(std::pair<T, T> a, std::pair<T, T> b
     }
     return a.second > b.first;
 }
+
+/**
+ * Polynomial string hashing modulo the Mersenne prime 2^61 - 1. Used to
+ * identify the children of a node by the hash of their source code, so that
+ * a candidate source can be looked up without being materialized.
+ */
+constexpr auto HASH_MODULUS = (uint64_t{1} << 61) - 1;
+constexpr auto HASH_BASE = uint64_t{1000003};
+
+auto hash_multiply(uint64_t a, uint64_t b) -> uint64_t {
+    auto product = static_cast<unsigned __int128>(a) * b;
+    auto result = static_cast<uint64_t>(product & HASH_MODULUS) + static_cast<uint64_t>(product >> 61);
+    return result >= HASH_MODULUS ? result - HASH_MODULUS : result;
+}
+
+auto hash_power(size_t exponent) -> uint64_t {
+    auto result = uint64_t{1};
+    auto base = HASH_BASE;
+    while (exponent > 0) {
+        if ((exponent & 1) != 0) {
+            result = hash_multiply(result, base);
+        }
+        base = hash_multiply(base, base);
+        exponent >>= 1;
+    }
+    return result;
+}
+
+/**
+ * Hash of a followed by a string with the given hash and length.
+ */
+auto hash_concat(uint64_t a, uint64_t b, size_t b_length) -> uint64_t {
+    auto result = hash_multiply(a, hash_power(b_length)) + b;
+    return result >= HASH_MODULUS ? result - HASH_MODULUS : result;
+}
+
+auto hash_append(uint64_t hash, std::string_view str) -> uint64_t {
+    for (auto c : str) {
+        hash = hash_multiply(hash, HASH_BASE) + static_cast<uint8_t>(c) + 1;
+        hash = hash >= HASH_MODULUS ? hash - HASH_MODULUS : hash;
+    }
+    return hash;
+}
+
+/**
+ * Hashes of all prefixes of a string, the i:th element is the hash of the
+ * first i characters.
+ */
+auto prefix_hashes(std::string_view str) -> std::vector<uint64_t> {
+    auto result = std::vector<uint64_t>{0};
+    result.reserve(str.size() + 1);
+    for (auto c : str) {
+        result.emplace_back(hash_append(result.back(), std::string_view(&c, 1)));
+    }
+    return result;
+}
+
+auto substring_hash(const std::vector<uint64_t>& prefixes, size_t start, size_t end) -> uint64_t {
+    auto removed = hash_multiply(prefixes[start], hash_power(end - start));
+    return prefixes[end] >= removed ? prefixes[end] - removed
+                                    : prefixes[end] + HASH_MODULUS - removed;
+}
+
+/**
+ * Compute the hash and the length of the string that results from applying
+ * a sorted, non-overlapping collection of rewrites.
+ */
+auto hash_rewrites(const std::string& original, const std::vector<uint64_t>& prefixes,
+                   const rewrite_collection& rewrites) -> std::pair<uint64_t, size_t> {
+    auto hash = uint64_t{};
+    auto length = std::size_t{};
+    auto pos = std::size_t{};
+    for (const auto& [start, end, replacement] : rewrites) {
+        hash = hash_concat(hash, substring_hash(prefixes, pos, start), start - pos);
+        hash = hash_append(hash, replacement);
+        length += (start - pos) + replacement.size();
+        pos = end;
+    }
+    hash = hash_concat(hash, substring_hash(prefixes, pos, original.size()), original.size() - pos);
+    length += original.size() - pos;
+    return {hash, length};
+}
+
+/**
+ * Check if applying a sorted, non-overlapping collection of rewrites to the
+ * original string results in the expected string.
+ */
+auto rewrites_produce(std::string_view original, const rewrite_collection& rewrites,
+                      std::string_view expected) -> bool {
+    auto pos = std::size_t{};
+    for (const auto& [start, end, replacement] : rewrites) {
+        auto kept = original.substr(pos, start - pos);
+        if (expected.substr(0, kept.size()) != kept) {
+            return false;
+        }
+        expected.remove_prefix(kept.size());
+        if (expected.substr(0, replacement.size()) != replacement) {
+            return false;
+        }
+        expected.remove_prefix(replacement.size());
+        pos = end;
+    }
+    return expected == original.substr(pos);
+}
+
+const auto no_patches = std::vector<patch_id>{};
+
+/* the amount of source code that makes it worthwhile to add an analysis thread */
+constexpr auto BYTES_PER_ANALYSIS_THREAD = std::size_t{32 * 1024};
+
+/* the largest amount of member source code that is analyzed together when a
+ * file is split, smaller chunks spend more time on the shared class context */
+constexpr auto BYTES_PER_CHUNK = std::size_t{16 * 1024};
+
+/* chunks end at members whose hash is divisible by this, so that an edit
+ * only moves the boundaries of nearby chunks */
+constexpr auto CHUNK_BOUNDARY_DIVISOR = uint64_t{4};
+
+/* a range of source offsets */
+using source_range = std::pair<size_t, size_t>;
+
+/* a member and the code between the braces of its body */
+struct splittable_member {
+    source_range range;
+    source_range body;
+};
+
+/**
+ * Find the members of top-level classes and interfaces that have a body of
+ * their own: methods, constructors, initializers and nested types. The body
+ * of any of them can be emptied while leaving the rest of the class valid.
+ * Fields are not included since the members depend on them. Enum and
+ * annotation bodies are not split.
+ */
+auto find_splittable_members(const parser::token_collection& tokens)
+    -> std::vector<splittable_member> {
+    auto result = std::vector<splittable_member>{};
+    auto offset = std::size_t{};
+    auto depth = std::size_t{};
+    auto parens = std::size_t{};
+    auto splittable_type = true;
+    auto member_start = std::size_t{};
+    auto body_start = std::size_t{};
+    auto has_initializer = false;
+    auto previous = std::string_view{};
+    for (const auto& [type, content] : tokens) {
+        offset += content.size();
+        if (type == parser::token_type::whitespace ||
+            type == parser::token_type::single_line_comment ||
+            type == parser::token_type::multi_line_comment) {
+            continue;
+        }
+        if (depth == 0 && type == parser::token_type::keyword &&
+            (content == "enum" || (content == "interface" && previous == "@"))) {
+            splittable_type = false;
+        }
+        previous = content;
+        if (type == parser::token_type::op && content == "=" && depth == 1 && parens == 0) {
+            has_initializer = true;
+        }
+        if (type != parser::token_type::sep) {
+            continue;
+        }
+        if (content == "{") {
+            if (depth == 0) {
+                member_start = offset;
+                has_initializer = false;
+                parens = 0;
+            } else if (depth == 1) {
+                body_start = offset;
+            }
+            depth++;
+        } else if (content == "}" && depth > 0) {
+            depth--;
+            if (depth == 0) {
+                splittable_type = true;
+            } else if (depth == 1 && parens == 0) {
+                if (splittable_type && !has_initializer) {
+                    result.push_back({{member_start, offset}, {body_start, offset - 1}});
+                }
+                member_start = offset;
+                has_initializer = false;
+            }
+        } else if (depth == 1 && content == "(") {
+            parens++;
+        } else if (depth == 1 && content == ")" && parens > 0) {
+            parens--;
+        } else if (depth == 1 && parens == 0 && content == ";") {
+            member_start = offset;
+            has_initializer = false;
+        }
+    }
+    return result;
+}
+
+/**
+ * Group consecutive members into chunks and return the chunk of every
+ * member. A chunk ends at a member chosen by its content once the chunk
+ * has a quarter of chunk_bytes bytes, and always at chunk_bytes.
+ */
+auto group_members(const std::string& source, const std::vector<splittable_member>& members,
+                   size_t chunk_bytes) -> std::vector<size_t> {
+    auto result = std::vector<size_t>{};
+    auto chunk = std::size_t{};
+    auto chunk_size = std::size_t{};
+    for (const auto& member : members) {
+        const auto& [start, end] = member.range;
+        result.emplace_back(chunk);
+        chunk_size += end - start;
+        auto hash = hash_append(0, std::string_view(source).substr(start, end - start));
+        if (chunk_size >= chunk_bytes ||
+            (chunk_size >= chunk_bytes / 4 && hash % CHUNK_BOUNDARY_DIVISOR == 0)) {
+            chunk++;
+            chunk_size = 0;
+        }
+    }
+    return result;
+}
+
+/**
+ * The bodies that are left out when analyzing a chunk, those of the members
+ * of other chunks. Their headers are kept, so that the declarations of the
+ * whole class are available, for example to type calls to its methods.
+ */
+auto removed_members(const std::vector<splittable_member>& members,
+                     const std::vector<size_t>& member_chunks, size_t chunk)
+    -> std::vector<source_range> {
+    auto result = std::vector<source_range>{};
+    for (auto i = std::size_t{}; i < members.size(); i++) {
+        if (member_chunks[i] != chunk && members[i].body.first < members[i].body.second) {
+            result.emplace_back(members[i].body);
+        }
+    }
+    return result;
+}
+
+/**
+ * The tokens of a file where the removed bodies have been replaced by
+ * whitespace. Offsets are kept, so rewrites found in the chunk apply to the
+ * original file.
+ */
+auto chunk_tokens(const parser::token_collection& tokens, const std::vector<source_range>& removed)
+    -> parser::token_collection {
+    auto result = parser::token_collection{};
+    auto offset = std::size_t{};
+    auto member = std::size_t{};
+    for (const auto& token : tokens) {
+        auto start = offset;
+        offset += token.second.size();
+        while (member < removed.size() && removed[member].second <= start) {
+            member++;
+        }
+        if (member == removed.size() || start < removed[member].first) {
+            result.emplace_back(token);
+        } else if (start == removed[member].first) {
+            const auto& [member_start, member_end] = removed[member];
+            result.emplace_back(parser::token_type::whitespace,
+                                std::string(member_end - member_start, ' '));
+        }
+    }
+    return result;
+}
+
+/**
+ * The source code with the removed bodies left out. A chunk is cached by
+ * the hash of this text, which does not change when the bodies of other
+ * members are edited.
+ */
+auto compact_source(const std::string& source, const std::vector<source_range>& removed)
+    -> std::string {
+    auto result = std::string{};
+    auto pos = std::size_t{};
+    for (const auto& [start, end] : removed) {
+        result.append(source, pos, start - pos);
+        pos = end;
+    }
+    result.append(source, pos);
+    return result;
+}
+
+/**
+ * Map an offset in the source to the offset in the compact source.
+ */
+auto compact_offset(const std::vector<source_range>& removed, size_t offset) -> size_t {
+    auto result = offset;
+    for (const auto& [start, end] : removed) {
+        if (end > offset) {
+            break;
+        }
+        result -= end - start;
+    }
+    return result;
+}
+
+/**
+ * Map an offset in the compact source to the offset in the source. An
+ * offset where a body was removed is placed after the body when it starts
+ * a rewrite, since nodes start at tokens that are kept, and before the
+ * body when it ends one.
+ */
+auto expand_offset(const std::vector<source_range>& removed, size_t offset, bool after)
+    -> size_t {
+    for (const auto& [start, end] : removed) {
+        if (start > offset || (start == offset && !after)) {
+            break;
+        }
+        offset += end - start;
+    }
+    return offset;
+}
+
+/**
+ * Check if the space-separated tokens of a sequence occur next to each
+ * other in a list of tokens.
+ */
+auto contains_token_sequence(const std::vector<std::string_view>& tokens, std::string_view sequence)
+    -> bool {
+    auto parts = std::vector<std::string_view>{};
+    for (auto pos = sequence.find(' '); pos != std::string_view::npos; pos = sequence.find(' ')) {
+        parts.emplace_back(sequence.substr(0, pos));
+        sequence.remove_prefix(pos + 1);
+    }
+    parts.emplace_back(sequence);
+    return std::search(tokens.begin(), tokens.end(), parts.begin(), parts.end()) != tokens.end();
+}
+
+/**
+ * Read rewrites written by write_cached_rewrites. The file starts with the
+ * key it was written for, which must match the given key, followed by one
+ * rewrite per record: the rule, the range and the length of the
+ * replacement on one line, followed by the replacement and a newline.
+ */
+auto read_cached_rewrites(const std::filesystem::path& path, const std::string& key)
+    -> std::optional<std::set<std::pair<rule_id, rewrite_type>>> {
+    auto f = std::ifstream(path, std::ios::binary);
+    if (!f) {
+        return {};
+    }
+    auto stored_key = std::string(key.size(), '\0');
+    if (!f.read(stored_key.data(), std::streamsize(key.size())) || stored_key != key) {
+        return {};
+    }
+    auto result = std::set<std::pair<rule_id, rewrite_type>>{};
+    auto rule = rule_id{};
+    auto start = std::size_t{};
+    auto end = std::size_t{};
+    auto length = std::size_t{};
+    while (f >> rule >> start >> end >> length && f.get() == '\n') {
+        auto replacement = std::string(length, '\0');
+        if (!f.read(replacement.data(), std::streamsize(length)) || f.get() != '\n') {
+            return {};
+        }
+        result.emplace(rule, rewrite_type{start, end, std::move(replacement)});
+    }
+    if (!f.eof()) {
+        return {};
+    }
+    return result;
+}
+
+/**
+ * Write rewrites to a cache file. The file is written under a temporary
+ * name and then renamed, so that concurrent readers never see a partial
+ * file. Failures are ignored, the analysis is rerun on the next lookup.
+ */
+auto write_cached_rewrites(const std::filesystem::path& path, const std::string& key,
+                           const std::set<std::pair<rule_id, rewrite_type>>& rewrites) -> void {
+    auto temporary = path;
+    auto thread = std::hash<std::thread::id>{}(std::this_thread::get_id());
+    temporary += fmt::format(".{}.{}", getpid(), thread);
+    auto f = std::ofstream(temporary, std::ios::binary);
+    f << key;
+    for (const auto& [rule, rewrite] : rewrites) {
+        const auto& [start, end, replacement] = rewrite;
+        f << rule << ' ' << start << ' ' << end << ' ' << replacement.size() << '\n'
+          << replacement << '\n';
+    }
+    /* errors of the final flush are only reported by close */
+    f.close();
+    auto error = std::error_code{};
+    if (f) {
+        std::filesystem::rename(temporary, path, error);
+    }
+    if (!f || error) {
+        std::filesystem::remove(temporary, error);
+    }
+}
+
+/**
+ * Lock a mutex and add the time spent waiting for it to a counter.
+ */
+auto timed_lock(std::mutex& mutex, std::chrono::steady_clock::duration& waited)
+    -> std::unique_lock<std::mutex> {
+    auto start = std::chrono::steady_clock::now();
+    auto lock = std::unique_lock{mutex};
+    waited += std::chrono::steady_clock::now() - start;
+    return lock;
+}
+
+/* memory of an edge in the rewrite graph, an element of the children of
+ * the parent and an entry in its hash set of children */
+constexpr auto EDGE_BYTES = sizeof(node_id) + sizeof(std::pair<const uint64_t, node_id>) +
+                            2 * sizeof(void*);
+
+/**
+ * The size of a string after the rewrites have been applied to it.
+ */
+auto rewritten_size(size_t size, const rewrite_collection& rewrites) -> size_t {
+    for (const auto& [start, end, replacement] : rewrites) {
+        size += replacement.size();
+        size -= end - start;
+    }
+    return size;
+}
+
+/**
+ * Estimate the heap memory held by a node and its source code.
+ */
+auto node_bytes(const node_data_type& node, const std::string& source) -> size_t {
+    auto result = sizeof(node_data_type) + sizeof(std::string) + source.capacity() +
+                  node.creation_rule.capacity() + EDGE_BYTES;
+    for (const auto& rewrite : node.creation_rewrites) {
+        result += sizeof(rewrite_type) + std::get<2>(rewrite).capacity();
+    }
+    return result;
+}
+
+/**
+ * The resident set size of the process in bytes, or zero where it can not
+ * be read.
+ */
+auto resident_bytes() -> size_t {
+    auto f = std::ifstream("/proc/self/statm");
+    auto size = std::size_t{};
+    auto resident = std::size_t{};
+    if (!(f >> size >> resident)) {
+        return 0;
+    }
+    return resident * static_cast<size_t>(sysconf(_SC_PAGESIZE));
+}
+
+auto store_max(std::atomic<size_t>& target, size_t value) -> void {
+    auto current = target.load();
+    while (current < value && !target.compare_exchange_weak(current, value)) {
+    }
+}
+
+/**
+ * The resident set size and the time sampled around the Soufflé runs of an
+ * analysis. Helper threads that analyze chunks of a file share the samples
+ * of the worker that analyzes the file.
+ */
+struct souffle_samples {
+    std::atomic<size_t> peak = 0;
+    std::atomic<size_t> growth = 0;
+    std::atomic<std::chrono::steady_clock::rep> time = 0;
+};
+thread_local souffle_samples* current_souffle_samples = nullptr;
 } // namespace
 
-auto program::create_id() -> size_t {
-    return id_counter++;
+/**
+ * Store a node and its source code, and return the id of the node. Must be
+ * called with the work mutex held while the graph is being built.
+ */
+auto program::create_node(node_data_type node, std::string source) -> node_id {
+    node.id = node_data.size();
+    memory_per_file[node.root].graph_bytes += node_bytes(node, source);
+    node_data.emplace_back(std::move(node));
+    node_sources.emplace_back(std::move(source));
+    return node_data.back().id;
 }
 
 auto program::add_file(const std::string& file) -> size_t {
     node_data_type node;
-    node.id = create_id();
-    node.source_code = file;
     node.creation_rule = "file";
-    node.parent = node.id;
-    node_data[node.id] = node;
-    pending_root_nodes.emplace_front(node.id);
-    return node.id;
+    node.parent = node_data.size();
+    node.root = node_data.size();
+    auto id = create_node(std::move(node), file);
+    pending_root_nodes.emplace_front(id);
+    file_count++;
+    return id;
 }
 
 auto program::disable_rule(const rule_id& rule) -> void { disabled_rules.emplace(rule); }
 
+/**
+ * Limit the time spent on each file. The deadline is checked while parsing
+ * and between Soufflé runs, a file that runs out of time is skipped and none
+ * of its patches are reported.
+ */
+auto program::set_timeout(std::chrono::milliseconds duration) -> void { timeout = duration; }
+
+auto program::get_timed_out_files() const -> std::vector<node_id> {
+    return {timed_out_files.begin(), timed_out_files.end()};
+}
+
+/**
+ * Limit the estimated memory held by the rewrite graph of each file. A file
+ * that grows beyond the limit is skipped and none of its patches are
+ * reported, like a file that times out.
+ */
+auto program::set_memory_limit(size_t bytes) -> void { memory_limit = bytes; }
+
+auto program::get_memory_limited_files() const -> std::vector<node_id> {
+    return {memory_limited_files.begin(), memory_limited_files.end()};
+}
+
+auto program::get_memory_statistics() const -> std::unordered_map<node_id, memory_statistics> {
+    auto lock = std::unique_lock{work_mutex};
+    return memory_per_file;
+}
+
+/**
+ * Skip a file once its rewrite graph holds more memory than the limit. Must
+ * be called with the work mutex held.
+ */
+auto program::exceeds_memory_limit(node_id file) -> bool {
+    if (!memory_limit || memory_per_file[file].graph_bytes <= *memory_limit) {
+        return false;
+    }
+    if (memory_limited_files.emplace(file).second) {
+        remove_patches_for_file(file);
+    }
+    return true;
+}
+
+auto program::set_conflict_policy(conflict_policy policy) -> void { on_conflict = policy; }
+
+auto program::get_merge_conflicts() const -> const std::vector<merge_conflict>& {
+    return merge_conflicts;
+}
+
+auto program::get_conflicted_files() const -> std::vector<node_id> {
+    return {conflicted_files.begin(), conflicted_files.end()};
+}
+
+/**
+ * Set the number of threads used for the analysis, both for running files
+ * side by side and for running Soufflé on large files.
+ */
+auto program::set_jobs(size_t count) -> void { jobs = std::max(count, size_t{1}); }
+
+/**
+ * Analyze files of at least this many bytes one chunk of class members at a
+ * time, zero disables splitting. Chunks hold at most this many bytes of
+ * members.
+ */
+auto program::set_split_threshold(size_t bytes) -> void { split_threshold = bytes; }
+
+/**
+ * Store analysis results in a directory and reuse them for files, or split
+ * chunks of files, that have been analyzed before. Files below the split
+ * threshold are cached as a whole, so any edit misses the cache; results
+ * are only reused per chunk of members for files that are split.
+ */
+auto program::set_cache_directory(std::filesystem::path directory) -> void {
+    cache_directory = std::move(directory);
+}
+
+/**
+ * Register a rule that depends on the whole file. When a file is split, a
+ * rewrite of such a rule is kept only if every chunk of the file finds it.
+ */
+auto program::add_file_level_rule(const rule_id& rule) -> void { file_level_rules.emplace(rule); }
+
+auto program::is_split(const std::string& source) const -> bool {
+    return split_threshold > 0 && source.size() >= split_threshold;
+}
+
+/**
+ * The number of threads that the analysis of a file would benefit from.
+ * Split files run their chunks side by side, other files are run
+ * single-threaded unless Soufflé was built with support for threads.
+ */
+auto program::analysis_threads_for(const std::string& source) const -> size_t {
+    auto wanted = std::clamp(source.size() / BYTES_PER_ANALYSIS_THREAD, size_t{1}, jobs);
+    if (is_split(source)) {
+        return wanted;
+    }
+#ifdef LOGIFIX_PARALLEL_SOUFFLE
+    return wanted;
+#else
+    return 1;
+#endif
+}
+
+/**
+ * Record the size of every relation and the time spent on every file. This
+ * makes it possible to find the rules and files that are most expensive.
+ */
+auto program::enable_rule_profiling() -> void { profile_rules = true; }
+
+auto program::get_rule_profile() const -> const rule_profile& { return profile; }
+
+/**
+ * Run the analysis once per file without exploring the rewrite graph. The
+ * rewrites of enabled rules are passed to the handler as soon as a file is
+ * done, together with the source code of the file. The handler is called
+ * concurrently from the worker threads. No patches are created.
+ */
+auto program::enable_scan_mode(
+    std::function<void(node_id, const std::string&, const finding_collection&)> handler)
+    -> void {
+    report_findings = std::move(handler);
+}
+
+/**
+ * Check if the remaining nodes of a file should be skipped because the file
+ * ran out of time or had a merge conflict. Must be called with the work
+ * mutex held while the graph is being built.
+ */
+auto program::is_skipped_file(node_id file) const -> bool {
+    return timed_out_files.find(file) != timed_out_files.end() ||
+           memory_limited_files.find(file) != memory_limited_files.end() ||
+           conflicted_files.find(file) != conflicted_files.end();
+}
+
+/**
+ * Register the tokens that must occur in a file for the rule to match. A
+ * trigger of several space-separated tokens matches when they occur next
+ * to each other, ignoring whitespace and comments. A rule without triggers
+ * may match any file.
+ */
+auto program::set_rule_triggers(const rule_id& rule, std::vector<std::string> triggers) -> void {
+    rule_triggers[rule] = std::move(triggers);
+}
+
+/**
+ * Count the enabled rules that may match a file given its tokens. When no
+ * rules have been registered every file is assumed to be a candidate.
+ */
+auto program::count_candidate_rules(const parser::token_collection& tokens) const -> size_t {
+    if (rule_triggers.empty()) {
+        return 1;
+    }
+    auto significant = std::vector<std::string_view>{};
+    auto contents = std::unordered_set<std::string_view>{};
+    for (const auto& [type, content] : tokens) {
+        if (type != parser::token_type::whitespace &&
+            type != parser::token_type::single_line_comment &&
+            type != parser::token_type::multi_line_comment) {
+            significant.emplace_back(content);
+            contents.emplace(content);
+        }
+    }
+    auto matches = [&](std::string_view trigger) {
+        if (trigger.find(' ') == std::string_view::npos) {
+            return contents.find(trigger) != contents.end();
+        }
+        return contains_token_sequence(significant, trigger);
+    };
+    return std::count_if(rule_triggers.begin(), rule_triggers.end(), [&](const auto& rule) {
+        const auto& [id, triggers] = rule;
+        if (disabled_rules.find(id) != disabled_rules.end()) {
+            return false;
+        }
+        return triggers.empty() || std::any_of(triggers.begin(), triggers.end(), matches);
+    });
+}
+
 /**
  * Take a string and a rewrite, apply the rewrite and return the
  * result.
@@ -177,45 +825,131 @@ auto program::split_rewrite(const std::string& original, const rewrite_type& rew
     return result;
 }
 
-auto program::get_recursive_merge_result_for_node(node_id id) const -> std::string {
-    auto node = node_data.at(id);
-    for (auto child_id : node.children) {
-        if (node_data.at(child_id).creation_rule == "merge") {
-            return get_recursive_merge_result_for_node(child_id);
+/**
+ * Follow the merge nodes below a node to the one that combines all of the
+ * rewrites found below it.
+ */
+auto program::get_merge_result_node(node_id id) const -> node_id {
+    auto is_merge = [this](node_id child) { return node_data.at(child).creation_rule == "merge"; };
+    while (true) {
+        const auto& children = node_data.at(id).children;
+        auto merge = std::find_if(children.begin(), children.end(), is_merge);
+        if (merge == children.end()) {
+            return id;
         }
+        id = *merge;
     }
-    return node.source_code;
 }
 
-auto program::get_patches_for_file(node_id id) const -> std::vector<patch_id> {
-    std::vector<patch_id> result;
-    for (auto child_id : node_data.at(id).children) {
-        auto child = node_data.at(child_id);
-        if (disabled_rules.find(child.creation_rule) != disabled_rules.end()) {
-            continue;
-        }
-        result.emplace_back(child.id);
+auto program::get_recursive_merge_result_for_node(node_id id) const -> const std::string& {
+    return node_sources.at(get_merge_result_node(id));
+}
+
+/**
+ * The source code of a node, rebuilt from the nearest ancestor whose source
+ * code has not been dropped. Must be called with the work mutex held.
+ */
+auto program::rebuild_source(node_id id) const -> std::string {
+    auto path = std::vector<node_id>{};
+    while (node_data.at(id).compacted) {
+        path.emplace_back(id);
+        id = node_data.at(id).parent;
+    }
+    auto result = node_sources.at(id);
+    for (auto it = path.rbegin(); it != path.rend(); it++) {
+        result = apply_rewrites(result, node_data.at(*it).creation_rewrites);
     }
     return result;
 }
 
-auto program::get_patches_for_rule(const rule_id& rule) const -> std::vector<patch_id> {
-    auto result = std::vector<patch_id>{};
-    for (auto node_id = std::size_t{}; node_id < id_counter; node_id++) {
-        auto node = node_data.at(node_id);
-        if (node.parent == node_id) {
-            for (auto child_id : node_data.at(node.id).children) {
-                if (rule == node_data.at(child_id).creation_rule) {
-                    result.emplace_back(child_id);
-                }
-            }
+/**
+ * Drop the source code of the intermediate nodes of a file whose graph has
+ * been explored. The file itself and the merge results of its patches are
+ * kept, as they are all that is needed to build the result, and so are
+ * patches that have not been expanded yet. Must be called with the work
+ * mutex held.
+ */
+auto program::compact_file(node_id file) -> void {
+    auto kept = std::unordered_set<node_id>{file};
+    for (auto patch : node_data.at(file).children) {
+        kept.emplace(get_merge_result_node(patch));
+    }
+    auto& graph_bytes = memory_per_file[file].graph_bytes;
+    auto stack = std::vector<node_id>(node_data.at(file).children);
+    while (!stack.empty()) {
+        auto& node = node_data.at(stack.back());
+        stack.pop_back();
+        stack.insert(stack.end(), node.children.begin(), node.children.end());
+        if (node.compacted || kept.find(node.id) != kept.end()) {
+            continue;
         }
+        graph_bytes -= node_sources.at(node.id).capacity();
+        std::string{}.swap(node_sources.at(node.id));
+        node.compacted = true;
     }
-    return result;
+}
+
+auto program::get_patches_for_file(node_id id) const -> const std::vector<patch_id>& {
+    auto it = patches_by_file.find(id);
+    return it == patches_by_file.end() ? no_patches : it->second;
+}
+
+auto program::get_patches_for_rule(const rule_id& rule) const -> const std::vector<patch_id>& {
+    auto it = patches_by_rule.find(rule);
+    return it == patches_by_rule.end() ? no_patches : it->second;
+}
+
+/**
+ * Add a child of a root node to the patch indexes, unless its rule is
+ * disabled. Must be called with the work mutex held.
+ */
+auto program::index_patch(const node_data_type& patch) -> void {
+    if (disabled_rules.find(patch.creation_rule) != disabled_rules.end()) {
+        return;
+    }
+    patches_by_rule[patch.creation_rule].emplace_back(patch.id);
+    patches_by_file[patch.root].emplace_back(patch.id);
+    all_patches.emplace_back(patch.id);
+}
+
+/**
+ * Remove all patches of a file from the indexes, used when a file runs out
+ * of time. Must be called with the work mutex held.
+ */
+auto program::remove_patches_for_file(node_id file) -> void {
+    auto belongs_to_file = [this, file](patch_id patch) {
+        return node_data.at(patch).root == file;
+    };
+    for (auto& [rule, patches] : patches_by_rule) {
+        patches.erase(std::remove_if(patches.begin(), patches.end(), belongs_to_file),
+                      patches.end());
+    }
+    all_patches.erase(std::remove_if(all_patches.begin(), all_patches.end(), belongs_to_file),
+                      all_patches.end());
+    patches_by_file.erase(file);
+}
+
+/**
+ * Files are analyzed in parallel so patches are indexed in the order they
+ * are found. Order them by file and then by creation so that the result
+ * does not depend on scheduling.
+ */
+auto program::sort_patch_indexes() -> void {
+    auto by_file = [this](patch_id a, patch_id b) {
+        return std::pair(node_data.at(a).root, a) < std::pair(node_data.at(b).root, b);
+    };
+    for (auto& [rule, patches] : patches_by_rule) {
+        std::sort(patches.begin(), patches.end(), by_file);
+    }
+    for (auto& [file, patches] : patches_by_file) {
+        std::sort(patches.begin(), patches.end());
+    }
+    std::sort(all_patches.begin(), all_patches.end(), by_file);
 }
 
 auto program::get_patch_data(patch_id patch) const -> std::tuple<rule_id, node_id, std::string> {
-    auto node = node_data.at(patch);
+    auto lock = std::unique_lock{work_mutex};
+    const auto& node = node_data.at(patch);
     return {node.creation_rule, node.parent, get_recursive_merge_result_for_node(node.id)};
 }
 
@@ -229,13 +963,13 @@ auto program::print_merge_conflict(const std::string& source, rewrite_collection
     fmt::print(stderr, "Related code fragment: {}\n",
                source.substr(fragment_start, fragment_end - fragment_start));
     for (const auto& node_id : node_ids) {
-        auto node = node_data.at(node_id);
-        auto parent = node_data.at(node.parent);
+        const auto& node = node_data.at(node_id);
+        const auto& parent_source = node_sources.at(node.parent);
         fmt::print(stderr, "Rule: ");
         fmt::print(stderr, fg(fmt::terminal_color::cyan), "{}\n", node.creation_rule);
         for (auto [start, end, replacement] : node.creation_rewrites) {
             fmt::print(stderr, "    Original: {} Replacement: {} Position: {}-{}\n",
-                       parent.source_code.substr(start, end - start), replacement, start, end);
+                       parent_source.substr(start, end - start), replacement, start, end);
         }
     }
     fmt::print(stderr, fg(fmt::terminal_color::yellow), "Rewrite collection:\n");
@@ -246,61 +980,108 @@ auto program::print_merge_conflict(const std::string& source, rewrite_collection
     }
 }
 
+/**
+ * Store a merge conflict so that it can be reported after the run. Must be
+ * called with the work mutex held while the graph is being built.
+ */
+auto program::record_merge_conflict(node_id file, const std::string& source,
+                                    rewrite_collection rewrites,
+                                    const std::vector<node_id>& node_ids,
+                                    const std::vector<node_id>& dropped) const -> void {
+    std::sort(rewrites.begin(), rewrites.end());
+    auto fragment_start = std::get<0>(rewrites.front());
+    auto fragment_end = std::size_t{};
+    for (const auto& rewrite : rewrites) {
+        fragment_end = std::max(fragment_end, std::get<1>(rewrite));
+    }
+    auto conflict = merge_conflict{};
+    conflict.file = file;
+    conflict.fragment = source.substr(fragment_start, fragment_end - fragment_start);
+    for (auto id : node_ids) {
+        conflict.rules.emplace_back(node_data.at(id).creation_rule);
+    }
+    for (auto id : dropped) {
+        conflict.dropped_rules.emplace_back(node_data.at(id).creation_rule);
+    }
+    /* results may be computed more than once for the same patches */
+    auto same_conflict = [&conflict](const merge_conflict& other) {
+        return other.file == conflict.file && other.fragment == conflict.fragment &&
+               other.rules == conflict.rules && other.dropped_rules == conflict.dropped_rules;
+    };
+    if (std::none_of(merge_conflicts.begin(), merge_conflicts.end(), same_conflict)) {
+        merge_conflicts.emplace_back(std::move(conflict));
+    }
+}
+
+/**
+ * Combine the given patches of a file. Unless conflicts abort the program,
+ * a patch that overlaps an earlier patch is dropped, or the file is left
+ * unchanged, and the conflict is recorded.
+ */
 auto program::get_result(node_id parent_id, const std::vector<patch_id>& patches) const
     -> std::string {
-    auto parent = node_data.at(parent_id);
+    const auto& parent_source = node_sources.at(parent_id);
     auto all_rewrites = rewrite_collection{};
+    auto conflicting_rewrites = rewrite_collection{};
+    auto dropped = std::vector<patch_id>{};
     for (auto patch : patches) {
-        auto data = get_patch_data(patch);
-        auto result = get_recursive_merge_result_for_node(patch);
-        auto rewrites = split_rewrite(parent.source_code, std::tuple(0ul, parent.source_code.size(), result));
+        const auto& result = get_recursive_merge_result_for_node(patch);
+        auto rewrites = split_rewrite(parent_source, std::tuple(0ul, parent_source.size(), result));
+        if (on_conflict != conflict_policy::abort) {
+            /* rewrites that an earlier patch also makes are not conflicts */
+            auto added = rewrite_collection{};
+            std::copy_if(rewrites.begin(), rewrites.end(), std::back_inserter(added),
+                         [&all_rewrites](const rewrite_type& rewrite) {
+                             return std::find(all_rewrites.begin(), all_rewrites.end(),
+                                              rewrite) == all_rewrites.end();
+                         });
+            if (rewrite_collections_overlap(all_rewrites, added) ||
+                rewrite_collection_overlap(added)) {
+                dropped.emplace_back(patch);
+                conflicting_rewrites.insert(conflicting_rewrites.end(), added.begin(),
+                                            added.end());
+                continue;
+            }
+            rewrites = std::move(added);
+        }
         all_rewrites.insert(all_rewrites.end(), rewrites.begin(), rewrites.end());
     }
+    if (!dropped.empty()) {
+        conflicting_rewrites.insert(conflicting_rewrites.end(), all_rewrites.begin(),
+                                    all_rewrites.end());
+        if (on_conflict == conflict_policy::skip_file) {
+            record_merge_conflict(parent_id, parent_source, conflicting_rewrites, patches,
+                                  patches);
+            return parent_source;
+        }
+        record_merge_conflict(parent_id, parent_source, conflicting_rewrites, patches, dropped);
+    }
     std::sort(all_rewrites.begin(), all_rewrites.end());
     all_rewrites.erase(std::unique(all_rewrites.begin(), all_rewrites.end()), all_rewrites.end());
     if (rewrite_collection_overlap(all_rewrites)) {
-        print_merge_conflict(parent.source_code, all_rewrites, patches);
+        print_merge_conflict(parent_source, all_rewrites, patches);
         std::exit(1);
     }
-    return apply_rewrites(parent.source_code, all_rewrites);
+    return apply_rewrites(parent_source, all_rewrites);
 }
 
-auto program::get_all_patches() const -> std::vector<patch_id> {
-    auto result = std::vector<patch_id>{};
-    for (auto node_id = std::size_t{}; node_id < id_counter; node_id++) {
-        auto node = node_data.at(node_id);
-        if (node.parent == node.id) {
-            for (auto child_id : node_data.at(node.id).children) {
-                auto child = node_data.at(child_id);
-                if (disabled_rules.find(child.creation_rule) != disabled_rules.end()) {
-                    continue;
-                }
-                result.emplace_back(child_id);
-            }
-        }
-    }
-    return result;
-}
+auto program::get_all_patches() const -> const std::vector<patch_id>& { return all_patches; }
 
 auto program::print_performance_metrics() -> void {
-    constexpr auto MAX_FILES_SHOWN = std::size_t{10};
-    constexpr auto MICROSECONDS_PER_SECOND = 1000.0 * 1000.0;
-    auto time_per_event_type = std::map<std::string, size_t>{};
-    for (auto [time, data] : timer::events) {
-        auto type = data;
-        time_per_event_type[type] += time;
+    auto time_per_event_type = std::map<std::string, std::chrono::duration<double>>{};
+    for (const auto& span : timer::get_spans()) {
+        time_per_event_type[span.name] += span.end - span.start;
     }
     fmt::print(stderr, "\n");
     for (const auto& [e, tot] : time_per_event_type) {
-        fmt::print(stderr, "{:20} {:20}\n", e, tot / MICROSECONDS_PER_SECOND);
+        fmt::print(stderr, "{:20} {:20}\n", e, tot.count());
     }
 }
 
 auto program::add_relations(node_id id, std::vector<std::tuple<node_id, node_id, std::string>>& result) const -> void {
-    auto node = node_data.at(id);
-    for (auto child_id : node.children) {
-        auto child = node_data.at(child_id);
-        result.emplace_back(node.id, child.id, child.creation_rule);
+    for (auto child_id : node_data.at(id).children) {
+        const auto& child = node_data.at(child_id);
+        result.emplace_back(id, child.id, child.creation_rule);
         add_relations(child.id, result);
     }
 }
@@ -319,7 +1100,6 @@ auto program::print_json_relations(node_id id) const -> void {
 }
 
 auto program::print_json_data(node_id id, std::string filename) const -> void {
-    auto node = node_data.at(id);
     std::cout << "{" << std::endl;
     std::cout << "    \"filename\": \"" << filename << "\"," << std::endl;
     std::cout << "    \"edges\": [" << std::endl;
@@ -328,11 +1108,41 @@ auto program::print_json_data(node_id id, std::string filename) const -> void {
     std::cout << "}";
 }
 
+auto program::get_thread_statistics() const -> const thread_statistics& { return thread_stats; }
+
+auto program::get_graph_statistics(node_id file) const -> graph_statistics {
+    auto result = graph_statistics{};
+    auto it = deduplicated_per_file.find(file);
+    if (it != deduplicated_per_file.end()) {
+        result.deduplicated = it->second;
+    }
+    /* the source code of most nodes has been dropped, their sizes follow
+     * from the rewrites */
+    auto stack = std::vector<std::tuple<node_id, size_t, size_t>>{
+        {file, 0, node_sources.at(file).size()}};
+    while (!stack.empty()) {
+        auto [id, depth, size] = stack.back();
+        stack.pop_back();
+        const auto& node = node_data.at(id);
+        result.nodes++;
+        result.max_depth = std::max(result.max_depth, depth);
+        result.source_bytes += size;
+        if (node.creation_rule == "merge") {
+            result.merge_nodes++;
+        } else if (id != file) {
+            result.children_per_rule[node.creation_rule]++;
+        }
+        for (auto child : node.children) {
+            stack.emplace_back(child, depth + 1,
+                               rewritten_size(size, node_data.at(child).creation_rewrites));
+        }
+    }
+    return result;
+}
+
 auto program::print_graphviz_data() const -> void {
     std::cout << "digraph {" << std::endl;
-    size_t i = 0;
-    for (auto node_id = std::size_t{}; node_id < id_counter; node_id++) {
-        auto node = node_data.at(node_id);
+    for (const auto& node : node_data) {
         if (node.creation_rule == "merge") {
             std::cout << "    " << node.parent << " -> " << node.id << " [style = dashed label=\"" << node.creation_rule << "\"];" << std::endl;
         } else {
@@ -342,150 +1152,705 @@ auto program::print_graphviz_data() const -> void {
     std::cout << "}" << std::endl;
 }
 
-auto program::run(std::function<void(node_id)> report_progress) -> void {
-    auto work_mutex = std::mutex{};
-    auto cv = std::condition_variable{};
+/**
+ * Estimate the cost of analyzing a file. The size of the AST, and thus the
+ * time spent in the parser and in Soufflé, grows with the number of
+ * non-whitespace tokens, and every candidate rule adds rewrites that must
+ * be explored. Files that do not lex are never analyzed.
+ */
+auto program::estimate_cost(const std::string& source) const -> size_t {
+    auto tokens = parser::lex(source);
+    if (!tokens) {
+        return 0;
+    }
+    auto num_tokens =
+        std::count_if(tokens->begin(), tokens->end(), [](const parser::token& token) {
+            auto type = std::get<0>(token);
+            return type != parser::token_type::whitespace &&
+                   type != parser::token_type::single_line_comment &&
+                   type != parser::token_type::multi_line_comment;
+        });
+    return num_tokens * count_candidate_rules(*tokens);
+}
+
+/**
+ * Pre-scan the pending root nodes in parallel and order them so that the
+ * most expensive files are analyzed first. This avoids a long tail where a
+ * single large file is still being analyzed after all other threads are idle.
+ * In lazy mode review starts with the first analyzed files, so the smallest
+ * files are analyzed first instead and the pre-scan is skipped.
+ */
+auto program::schedule_root_nodes() -> void {
+    if (lazy) {
+        std::stable_sort(pending_root_nodes.begin(), pending_root_nodes.end(),
+                         [this](node_id a, node_id b) {
+                             return node_sources[a].size() < node_sources[b].size();
+                         });
+        return;
+    }
+    auto roots = std::vector<node_id>(pending_root_nodes.begin(), pending_root_nodes.end());
+    auto costs = std::vector<size_t>(roots.size());
+    auto next = std::atomic<size_t>{};
+    auto thread_pool = std::vector<std::thread>{};
+    for (auto i = std::size_t{}; i < jobs; i++) {
+        thread_pool.emplace_back([&] {
+            for (auto j = next++; j < roots.size(); j = next++) {
+                timer::set_context(roots[j], roots[j]);
+                auto span = timer::span("estimate_cost");
+                costs[j] = estimate_cost(node_sources.at(roots[j]));
+            }
+        });
+    }
+    for (auto& t : thread_pool) {
+        t.join();
+    }
+    auto order = std::vector<size_t>(roots.size());
+    std::iota(order.begin(), order.end(), 0);
+    std::stable_sort(order.begin(), order.end(),
+                     [&costs](size_t a, size_t b) { return costs[a] > costs[b]; });
+    pending_root_nodes.clear();
+    for (auto j : order) {
+        pending_root_nodes.emplace_back(roots[j]);
+    }
+}
+
+auto program::run() -> void {
+    schedule_root_nodes();
+    process_pending_nodes();
+    sort_patch_indexes();
+}
+
+/**
+ * Explore the rewrite graphs below the given patches, for patches whose
+ * exploration was deferred by lazy mode. Every file gets a new deadline.
+ */
+auto program::expand(const std::vector<patch_id>& patches) -> void {
+    auto lock = std::unique_lock{work_mutex};
+    auto files = std::vector<node_id>{};
+    for (auto patch : patches) {
+        if (deferred_patches.erase(patch) == 0) {
+            continue;
+        }
+        const auto& node = node_data.at(patch);
+        if (timeout) {
+            deadlines[node.root] = std::chrono::steady_clock::now() + *timeout;
+        }
+        queue_child_node(patch);
+        files.emplace_back(node.root);
+    }
+    if (files.empty()) {
+        return;
+    }
+    if (serving) {
+        /* the workers of run pick up the nodes */
+        work_cv.notify_all();
+        file_done_cv.wait(lock, [&]() {
+            return std::all_of(files.begin(), files.end(),
+                               [this](node_id file) { return pending_per_file[file] == 0; });
+        });
+        return;
+    }
+    lock.unlock();
+    process_pending_nodes();
+}
+
+/**
+ * Keep the workers of run alive when they run out of work, so that
+ * patches can be expanded while other files are still being analyzed.
+ * run returns once serving has been turned off and the work is done.
+ */
+auto program::set_serving(bool value) -> void {
+    auto lock = std::unique_lock{work_mutex};
+    serving = value;
+    work_cv.notify_all();
+}
+
+/**
+ * Drop the files whose analysis has not started, when the results of the
+ * run are no longer needed. Files that are being analyzed are finished.
+ */
+auto program::cancel_pending_files() -> void {
+    auto lock = std::unique_lock{work_mutex};
+    pending_root_nodes.clear();
+    work_cv.notify_all();
+}
+
+/**
+ * The patches of the files that have been analyzed since the last call and
+ * their rules, in the order the files were finished.
+ */
+auto program::take_published_patches() -> std::vector<std::pair<rule_id, patch_id>> {
+    auto lock = std::unique_lock{work_mutex};
+    auto result = std::vector<std::pair<rule_id, patch_id>>{};
+    for (auto patch : published_patches) {
+        result.emplace_back(node_data[patch].creation_rule, patch);
+    }
+    published_patches.clear();
+    return result;
+}
+
+/**
+ * Block until patches have been published or all files have been analyzed.
+ */
+auto program::wait_for_published_patches() -> void {
+    auto lock = std::unique_lock{work_mutex};
+    file_done_cv.wait(lock, [this]() {
+        return !published_patches.empty() || analyzed_files == file_count;
+    });
+}
+
+auto program::count_analyzed_files() const -> size_t { return analyzed_files; }
+
+auto program::get_progress() const -> progress_snapshot {
+    auto result = progress_snapshot{};
+    result.files = file_count;
+    result.finished_files = finished_files;
+    result.analyzed_nodes = analyzed_nodes;
+    auto now = std::chrono::steady_clock::now();
+    auto lock = std::unique_lock{in_progress_mutex};
+    for (const auto& [file, started] : in_progress_files) {
+        if (now - started > result.slowest_file_time) {
+            result.slowest_file = file;
+            result.slowest_file_time = now - started;
+        }
+    }
+    return result;
+}
+
+/**
+ * Queue a node below a root node. Must be called with the work mutex held.
+ */
+auto program::queue_child_node(node_id id) -> void {
+    pending_per_file[node_data[id].root]++;
+    parent_prefix_hashes[node_data[id].parent].pending_children++;
+    pending_child_nodes.emplace_back(id);
+}
+
+/**
+ * Account for a node that has been analyzed, or skipped. Must be called
+ * with the work mutex held.
+ */
+auto program::finish_node(const node_data_type& node) -> void {
+    analyzed_nodes++;
+    if (node.id == node.root) {
+        analyzed_files++;
+    } else {
+        auto it = parent_prefix_hashes.find(node.parent);
+        if (--it->second.pending_children == 0) {
+            parent_prefix_hashes.erase(it);
+        }
+    }
+    if (--pending_per_file[node.root] == 0) {
+        compact_file(node.root);
+        file_done_cv.notify_all();
+        auto lock = std::unique_lock{in_progress_mutex};
+        if (in_progress_files.erase(node.root) > 0) {
+            finished_files++;
+        }
+    }
+}
+
+/**
+ * Only analyze the files when running, and explore the rewrite graph below
+ * a patch when it is expanded. Patches of files that time out or conflict
+ * while expanding are removed from the indexes at that point.
+ */
+auto program::enable_lazy_mode() -> void { lazy = true; }
+
+/**
+ * Check that a patch has not been removed because its file timed out or
+ * had a merge conflict.
+ */
+auto program::has_patch(patch_id patch) const -> bool {
+    auto lock = std::unique_lock{work_mutex};
+    return !is_skipped_file(node_data.at(patch).root);
+}
+
+/**
+ * Analyze pending nodes on a pool of worker threads until the graphs below
+ * them have been explored.
+ */
+auto program::process_pending_nodes() -> void {
     auto waiting_threads = std::size_t{};
     auto thread_pool = std::vector<std::thread>{};
-    auto const concurrency = std::thread::hardware_concurrency();
+    auto const concurrency = jobs;
+    /* threads that are neither running a worker nor lent to Soufflé */
+    auto available_threads = concurrency;
     auto done = false;
+    auto run_start = std::chrono::steady_clock::now();
+    thread_stats = thread_statistics{};
+    thread_stats.threads = concurrency;
     for (auto i = std::size_t{}; i < concurrency; i++) {
         thread_pool.emplace_back(std::thread([&] {
+            auto lock_wait = std::chrono::steady_clock::duration{};
+            auto condition_wait = std::chrono::steady_clock::duration{};
+            auto analysis = std::chrono::steady_clock::duration{};
+            auto souffle = std::chrono::steady_clock::duration{};
+            auto holds_thread = false;
+            const node_data_type* finished = nullptr;
+            auto sample_idle_workers = [&]() {
+                thread_stats.idle_workers.emplace_back(std::chrono::steady_clock::now() - run_start,
+                                                       waiting_threads);
+            };
             while (true) {
-                node_data_type current_node;
-                node_data_type parent_node;
+                const node_data_type* current = nullptr;
+                const node_data_type* parent = nullptr;
+                const std::string* current_source = nullptr;
+                const std::string* parent_source = nullptr;
                 bool current_node_has_parent = false;
+                auto deadline = parser::deadline_type{};
+                auto analysis_threads = std::size_t{1};
                 /* acquire work */
                 {
-                    auto lock = std::unique_lock{work_mutex};
-                    if (pending_child_nodes.empty() && pending_root_nodes.empty()) {
+                    auto lock = timed_lock(work_mutex, lock_wait);
+                    if (holds_thread) {
+                        available_threads++;
+                        holds_thread = false;
+                    }
+                    if (finished != nullptr) {
+                        finish_node(*finished);
+                        finished = nullptr;
+                    }
+                    auto has_work = [&]() {
+                        return !pending_child_nodes.empty() || !pending_root_nodes.empty();
+                    };
+                    if (!has_work() || available_threads == 0) {
                         waiting_threads++;
-                        if (waiting_threads == concurrency) {
-                            done = true;
-                            cv.notify_all();
-                        } else {
-                            auto wakeup_when = [&]() { return !pending_child_nodes.empty() || done; };
-                            cv.wait(lock, wakeup_when);
-                            waiting_threads--;
+                        sample_idle_workers();
+                        auto wait_start = std::chrono::steady_clock::now();
+                        while (!done && !(has_work() && available_threads > 0)) {
+                            if (waiting_threads == concurrency && !serving) {
+                                done = true;
+                                work_cv.notify_all();
+                            } else {
+                                work_cv.wait(lock);
+                            }
                         }
+                        condition_wait += std::chrono::steady_clock::now() - wait_start;
+                        waiting_threads--;
+                        sample_idle_workers();
                     }
                     if (done) {
+                        thread_stats.lock_wait += lock_wait;
+                        thread_stats.condition_wait += condition_wait;
+                        thread_stats.analysis += analysis;
+                        thread_stats.souffle += souffle;
                         return;
                     }
                     if (pending_child_nodes.empty()) {
-                        current_node = node_data[pending_root_nodes.front()];
+                        current = &node_data[pending_root_nodes.front()];
                         pending_root_nodes.pop_front();
-                        report_progress(current_node.id);
+                        pending_per_file[current->id]++;
+                        {
+                            auto lock = std::unique_lock{in_progress_mutex};
+                            in_progress_files.emplace(current->id,
+                                                      std::chrono::steady_clock::now());
+                        }
+                        if (timeout) {
+                            deadlines[current->id] = std::chrono::steady_clock::now() + *timeout;
+                        }
                     } else {
-                        current_node = node_data[pending_child_nodes.front()];
+                        current = &node_data[pending_child_nodes.front()];
                         pending_child_nodes.pop_front();
                         current_node_has_parent = true;
-                        parent_node = node_data[current_node.parent];
+                        parent = &node_data[current->parent];
+                        parent_source = &node_sources[current->parent];
                     }
+                    finished = current;
+                    current_source = &node_sources[current->id];
+                    /* skip the remaining nodes of a file that has run out of time */
+                    if (is_skipped_file(current->root)) {
+                        continue;
+                    }
+                    if (timeout) {
+                        deadline = deadlines.at(current->root);
+                    }
+                    /* large files may borrow the threads of idle workers */
+                    auto extra_threads = std::min(analysis_threads_for(*current_source) - 1,
+                                                  available_threads - 1);
+                    available_threads -= 1 + extra_threads;
+                    holds_thread = true;
+                    analysis_threads += extra_threads;
                 }
+                const auto& current_node = *current;
+                timer::set_context(current_node.root, current_node.id);
 
                 auto next_nodes = std::vector<node_data_type>{};
 
                 {
-                    auto rewrites = run_datalog_analysis(current_node.source_code);
-                    auto lock = std::unique_lock{work_mutex};
-                    for (const auto& [rule, rewrite] : rewrites) {
-                        node_data_type next_node;
-                        next_node.id = create_id();
-                        next_node.creation_rule = rule;
-                        next_node.source_code = apply_rewrite(current_node.source_code, rewrite);
-                        next_node.creation_rewrites = split_rewrite(current_node.source_code, rewrite);
-                        next_node.parent = current_node.id;
-                        node_data[current_node.id].children_hashset.emplace(next_node.source_code);
-                        node_data[next_node.id] = next_node;
-                        next_nodes.emplace_back(next_node);
+                    auto analysis_start = std::chrono::steady_clock::now();
+                    auto samples = souffle_samples{};
+                    current_souffle_samples = &samples;
+                    auto rewrites = run_datalog_analysis(*current_source, deadline, analysis_threads);
+                    current_souffle_samples = nullptr;
+                    analysis += std::chrono::steady_clock::now() - analysis_start;
+                    souffle += std::chrono::steady_clock::duration(samples.time.load());
+                    if (samples.peak > 0) {
+                        auto lock = timed_lock(work_mutex, lock_wait);
+                        auto& memory = memory_per_file[current_node.root];
+                        memory.peak_rss = std::max(memory.peak_rss, samples.peak.load());
+                        memory.peak_rss_growth =
+                            std::max(memory.peak_rss_growth, samples.growth.load());
+                    }
+                    if (analysis_threads > 1) {
+                        auto lock = timed_lock(work_mutex, lock_wait);
+                        available_threads += analysis_threads - 1;
+                        work_cv.notify_all();
+                    }
+                    if (profile_rules) {
+                        auto lock = std::unique_lock{profile_mutex};
+                        profile.time_per_file[current_node.root] +=
+                            std::chrono::steady_clock::now() - analysis_start;
+                    }
+                    if (!rewrites || (deadline && std::chrono::steady_clock::now() >= *deadline)) {
+                        auto lock = timed_lock(work_mutex, lock_wait);
+                        timed_out_files.emplace(current_node.root);
+                        remove_patches_for_file(current_node.root);
+                        continue;
+                    }
+                    if (report_findings) {
+                        auto findings = finding_collection{};
+                        for (const auto& finding : *rewrites) {
+                            if (disabled_rules.find(finding.first) == disabled_rules.end()) {
+                                findings.emplace_back(finding);
+                            }
+                        }
+                        std::sort(findings.begin(), findings.end(),
+                                  [](const auto& a, const auto& b) {
+                                      return std::tie(a.second, a.first) <
+                                             std::tie(b.second, b.first);
+                                  });
+                        report_findings(current_node.id, *current_source, findings);
+                        continue;
+                    }
+                    auto sources = std::vector<std::string>{};
+                    auto hashes = std::vector<uint64_t>{};
+                    {
+                        auto span = timer::span("split_rewrite");
+                        for (const auto& [rule, rewrite] : *rewrites) {
+                            node_data_type next_node;
+                            next_node.creation_rule = rule;
+                            next_node.creation_rewrites = split_rewrite(*current_source, rewrite);
+                            next_node.parent = current_node.id;
+                            next_node.root = current_node.root;
+                            sources.emplace_back(apply_rewrite(*current_source, rewrite));
+                            hashes.emplace_back(hash_append(0, sources.back()));
+                            next_nodes.emplace_back(std::move(next_node));
+                        }
+                    }
+                    auto lock = timed_lock(work_mutex, lock_wait);
+                    for (auto j = std::size_t{}; j < next_nodes.size(); j++) {
+                        auto& next_node = next_nodes[j];
+                        next_node.id = create_node(next_node, std::move(sources[j]));
+                        node_data[current_node.id].children_hashes.emplace(hashes[j], next_node.id);
                         node_data[current_node.id].children.emplace_back(next_node.id);
+                        if (!current_node_has_parent) {
+                            index_patch(next_node);
+                        }
+                    }
+                    if (exceeds_memory_limit(current_node.root)) {
+                        continue;
                     }
                 }
 
                 if (!current_node_has_parent) {
+                    auto lock = timed_lock(work_mutex, lock_wait);
                     for (const auto& next_node : next_nodes) {
                         if (disabled_rules.find(next_node.creation_rule) != disabled_rules.end()) {
                             continue;
                         }
-                        auto lock = std::unique_lock{work_mutex};
-                        pending_child_nodes.emplace_back(next_node.id);
+                        if (lazy) {
+                            deferred_patches.emplace(next_node.id);
+                            published_patches.emplace_back(next_node.id);
+                        } else {
+                            queue_child_node(next_node.id);
+                        }
                     }
                 } else {
 
+                    const auto& parent_node = *parent;
+                    auto span = timer::span("merge_check");
                     auto rewrites = rewrite_collection{};
                     std::vector<node_id> taken_nodes;
+                    std::vector<const rewrite_collection*> taken_rewrites;
+                    auto inverted = rewrites_invert(*parent_source, current_node.creation_rewrites);
+                    auto parent_hashes = std::shared_ptr<const std::vector<uint64_t>>{};
+                    if (!next_nodes.empty()) {
+                        {
+                            auto lock = timed_lock(work_mutex, lock_wait);
+                            parent_hashes = parent_prefix_hashes[parent_node.id].hashes;
+                        }
+                        if (!parent_hashes) {
+                            auto hashes = std::make_shared<const std::vector<uint64_t>>(
+                                prefix_hashes(*parent_source));
+                            auto lock = timed_lock(work_mutex, lock_wait);
+                            auto& shared = parent_prefix_hashes[parent_node.id].hashes;
+                            if (!shared) {
+                                shared = std::move(hashes);
+                            }
+                            parent_hashes = shared;
+                        }
+                    }
 
                     for (const auto& next_node : next_nodes) {
-                        auto inverted = rewrites_invert(parent_node.source_code, current_node.creation_rewrites);
                         /* Make sure that the inverted rewrites and the rewrites for the next node do not have any overlap */
                         if (!rewrite_collections_overlap(inverted, next_node.creation_rewrites)) {
                             /**
                              * We "backport" the rewrites for the next node to apply to
                              * the parent node and check if there's any child with
-                             * source code which matches these rewrites
+                             * source code which matches these rewrites. Children are
+                             * looked up by hash and only compared in full on a match.
                              */
                             auto adjusted = adjust_rewrites(inverted, next_node.creation_rewrites);
-                            auto candidate_string = apply_rewrites(parent_node.source_code, adjusted);
-                            if (parent_node.children_hashset.find(candidate_string) !=
-                                parent_node.children_hashset.end()) {
+                            std::sort(adjusted.begin(), adjusted.end());
+                            auto [hash, length] = hash_rewrites(*parent_source,
+                                                                *parent_hashes, adjusted);
+                            auto [first, last] = parent_node.children_hashes.equal_range(hash);
+                            auto found = false;
+                            for (auto it = first; it != last && !found; it++) {
+                                const std::string* sibling_source = nullptr;
+                                auto rebuilt = std::string{};
+                                {
+                                    auto lock = timed_lock(work_mutex, lock_wait);
+                                    sibling_source = &node_sources[it->second];
+                                    /* an earlier expansion of the sibling
+                                     * dropped its source code */
+                                    if (node_data[it->second].compacted) {
+                                        rebuilt = rebuild_source(it->second);
+                                        sibling_source = &rebuilt;
+                                    }
+                                }
+                                found = sibling_source->size() == length &&
+                                        rewrites_produce(*parent_source, adjusted,
+                                                         *sibling_source);
+                            }
+                            if (found) {
+                                auto lock = timed_lock(work_mutex, lock_wait);
+                                deduplicated_per_file[current_node.root]++;
                                 continue;
                             }
                         }
                         taken_nodes.emplace_back(next_node.id);
+                        taken_rewrites.emplace_back(&next_node.creation_rewrites);
                         rewrites.insert(rewrites.end(), next_node.creation_rewrites.begin(),
                                         next_node.creation_rewrites.end());
                     }
 
-                    if (!rewrites.empty()) {
-                        if (rewrite_collection_overlap(rewrites)) {
-                            print_merge_conflict(current_node.source_code, rewrites, taken_nodes);
+                    if (!rewrites.empty() && rewrite_collection_overlap(rewrites)) {
+                        auto lock = timed_lock(work_mutex, lock_wait);
+                        if (on_conflict == conflict_policy::abort) {
+                            print_merge_conflict(*current_source, rewrites, taken_nodes);
                             std::exit(1);
-                        } else {
-                            auto lock = std::unique_lock{work_mutex};
-                            node_data_type next_node;
-                            next_node.id = create_id();
-                            next_node.creation_rule = "merge";
-                            next_node.source_code = apply_rewrites(current_node.source_code, rewrites);
-                            next_node.creation_rewrites = rewrites;
-                            next_node.parent = current_node.id;
-                            node_data[next_node.id] = next_node;
-                            pending_child_nodes.emplace_back(next_node.id);
-                            node_data[current_node.id].children.emplace_back(next_node.id);
+                        }
+                        /* keep the rewrites of the nodes that were found first */
+                        auto kept = rewrite_collection{};
+                        auto dropped = std::vector<node_id>{};
+                        for (auto j = std::size_t{}; j < taken_nodes.size(); j++) {
+                            const auto& candidate = *taken_rewrites[j];
+                            if (rewrite_collections_overlap(kept, candidate) ||
+                                rewrite_collection_overlap(candidate)) {
+                                dropped.emplace_back(taken_nodes[j]);
+                            } else {
+                                kept.insert(kept.end(), candidate.begin(), candidate.end());
+                            }
+                        }
+                        if (on_conflict == conflict_policy::skip_file) {
+                            record_merge_conflict(current_node.root, *current_source, rewrites,
+                                                  taken_nodes, taken_nodes);
+                            conflicted_files.emplace(current_node.root);
+                            remove_patches_for_file(current_node.root);
+                            continue;
+                        }
+                        record_merge_conflict(current_node.root, *current_source, rewrites,
+                                              taken_nodes, dropped);
+                        rewrites = std::move(kept);
+                    }
+
+                    if (!rewrites.empty()) {
+                        node_data_type next_node;
+                        next_node.creation_rule = "merge";
+                        next_node.parent = current_node.id;
+                        next_node.root = current_node.root;
+                        auto source = apply_rewrites(*current_source, rewrites);
+                        next_node.creation_rewrites = std::move(rewrites);
+                        auto lock = timed_lock(work_mutex, lock_wait);
+                        auto id = create_node(std::move(next_node), std::move(source));
+                        node_data[current_node.id].children.emplace_back(id);
+                        if (!exceeds_memory_limit(current_node.root)) {
+                            queue_child_node(id);
                         }
                     }
 
                 }
 
                 /* notify all threads that there is more work available */
-                cv.notify_all();
+                work_cv.notify_all();
             }
         }));
     }
     for (auto& t : thread_pool) {
         t.join();
     }
+    thread_stats.wall_time = std::chrono::steady_clock::now() - run_start;
 }
 
 /**
  * Given a source file, create a new Soufflé program, run the analysis, extract
  * and perform rewrites and finally return the set of resulting strings and the
- * rule ids for each rewrite.
+ * rule ids for each rewrite. Returns nothing if the deadline was reached.
+ */
+auto program::run_datalog_analysis(const std::string& source,
+                                   const parser::deadline_type& deadline, size_t threads) const
+    -> std::optional<std::set<std::pair<rule_id, rewrite_type>>> {
+
+    /* files that do not lex can not be parsed */
+    auto tokens = std::optional<parser::token_collection>{};
+    {
+        auto span = timer::span("lex");
+        tokens = parser::lex(source);
+    }
+    if (!tokens) {
+        return std::set<std::pair<rule_id, rewrite_type>>{};
+    }
+
+    auto members = std::vector<splittable_member>{};
+    auto member_chunks = std::vector<size_t>{};
+    if (is_split(source)) {
+        auto span = timer::span("split_members");
+        members = find_splittable_members(*tokens);
+        /* chunks are never larger than the files that are split */
+        member_chunks =
+            group_members(source, members, std::min(BYTES_PER_CHUNK, split_threshold));
+    }
+    auto chunks = member_chunks.empty() ? 1 : member_chunks.back() + 1;
+    if (chunks < 2 && cache_directory) {
+        return run_cached_analysis(source, *tokens, {}, deadline, threads);
+    }
+    if (chunks < 2) {
+        return run_datalog_analysis(source, std::move(*tokens), deadline, threads);
+    }
+
+    /* analyze the chunks side by side, each on a single Soufflé thread */
+    auto results = std::vector<std::optional<std::set<std::pair<rule_id, rewrite_type>>>>(chunks);
+    auto next_chunk = std::atomic<size_t>{};
+    auto* samples = current_souffle_samples;
+    auto analyze_chunks = [&]() {
+        current_souffle_samples = samples;
+        for (auto chunk = next_chunk++; chunk < chunks; chunk = next_chunk++) {
+            results[chunk] = run_cached_analysis(
+                source, *tokens, removed_members(members, member_chunks, chunk), deadline, 1);
+        }
+    };
+    auto helpers = std::vector<std::thread>{};
+    for (auto i = std::size_t{1}; i < std::min(threads, chunks); i++) {
+        helpers.emplace_back(analyze_chunks);
+    }
+    analyze_chunks();
+    for (auto& helper : helpers) {
+        helper.join();
+    }
+
+    /* every chunk sees the declarations of the whole class, so rewrites of
+     * rules that look inside a single member are valid in the whole file,
+     * while file-level rules must agree in every chunk */
+    auto rewrites = std::set<std::pair<rule_id, rewrite_type>>{};
+    auto file_level_rewrites = std::map<std::pair<rule_id, rewrite_type>, size_t>{};
+    for (auto& result : results) {
+        if (!result) {
+            return {};
+        }
+        for (auto& rewrite : *result) {
+            if (file_level_rules.find(rewrite.first) != file_level_rules.end()) {
+                file_level_rewrites[rewrite]++;
+            } else {
+                rewrites.emplace(rewrite);
+            }
+        }
+    }
+    for (const auto& [rewrite, count] : file_level_rewrites) {
+        if (count == chunks) {
+            rewrites.emplace(rewrite);
+        }
+    }
+    return rewrites;
+}
+
+/**
+ * Run the Datalog program on a file with the bodies of some of its members
+ * removed. If a cache directory has been set, the result of an earlier run
+ * with the same compact source is reused. Cached rewrites are stored with
+ * offsets into the compact source, so they stay valid when removed bodies
+ * are edited.
  */
-auto program::run_datalog_analysis(const std::string& source) const
-    -> std::set<std::pair<rule_id, rewrite_type>> {
+auto program::run_cached_analysis(const std::string& source, const parser::token_collection& tokens,
+                                  const std::vector<std::pair<size_t, size_t>>& removed,
+                                  const parser::deadline_type& deadline, size_t threads) const
+    -> std::optional<std::set<std::pair<rule_id, rewrite_type>>> {
+    if (!cache_directory) {
+        return run_datalog_analysis(source, chunk_tokens(tokens, removed), deadline, threads);
+    }
+    auto compact = compact_source(source, removed);
+    auto hash = hash_append(hash_append(0, ANALYSIS_HASH), compact);
+    auto path = *cache_directory / fmt::format("{:016x}-{}", hash, compact.size());
+    /* files are named by hash, the full key is stored to rule out collisions */
+    auto key = fmt::format("{}\n{}\n{}\n", ANALYSIS_HASH, compact.size(), compact);
+
+    if (auto cached = read_cached_rewrites(path, key)) {
+        auto result = std::set<std::pair<rule_id, rewrite_type>>{};
+        for (const auto& [rule, rewrite] : *cached) {
+            const auto& [start, end, replacement] = rewrite;
+            auto source_start = expand_offset(removed, start, true);
+            auto source_end = start == end ? source_start : expand_offset(removed, end, false);
+            result.emplace(rule, rewrite_type{source_start, source_end, replacement});
+        }
+        return result;
+    }
+
+    auto result = run_datalog_analysis(source, chunk_tokens(tokens, removed), deadline, threads);
+    if (result) {
+        auto compact_rewrites = std::set<std::pair<rule_id, rewrite_type>>{};
+        for (const auto& [rule, rewrite] : *result) {
+            const auto& [start, end, replacement] = rewrite;
+            compact_rewrites.emplace(rule, rewrite_type{compact_offset(removed, start),
+                                                        compact_offset(removed, end), replacement});
+        }
+        write_cached_rewrites(path, key, compact_rewrites);
+    }
+    return result;
+}
+
+/**
+ * Run the Datalog program on the tokens of a file. The source code is used
+ * by the functors to look up the text of nodes.
+ */
+auto program::run_datalog_analysis(const std::string& source, parser::token_collection tokens,
+                                   const parser::deadline_type& deadline, size_t threads) const
+    -> std::optional<std::set<std::pair<rule_id, rewrite_type>>> {
 
     const auto* program_name = "logifix";
     const auto* filename = "file";
 
-    auto prog = std::unique_ptr<souffle::SouffleProgram>(
-        souffle::ProgramFactory::newInstance(program_name));
+    /* files without any trigger tokens can not produce any rewrites */
+    if (count_candidate_rules(tokens) == 0) {
+        return std::set<std::pair<rule_id, rewrite_type>>{};
+    }
+
+    auto prog = std::unique_ptr<souffle::SouffleProgram>{};
+    {
+        auto span = timer::span("instantiate");
+        prog.reset(souffle::ProgramFactory::newInstance(program_name));
+    }
+
+    prog->setNumThreads(threads);
+
+    /* make the source code available to the functors */
+    auto functor_state = functors::scoped_program(&prog->getSymbolTable(), source);
 
     /* add javadoc info to prog */
-    auto tokens = parser::lex(source);
-    if (tokens) {
+    {
+        auto span = timer::span("javadoc");
         auto* javadoc_references = prog->getRelation("javadoc_references");
-        for (auto token : *tokens) {
+        for (const auto& token : tokens) {
             if (std::get<0>(token) != parser::token_type::multi_line_comment) {
                 continue;
             }
@@ -498,20 +1863,35 @@ auto program::run_datalog_analysis(const std::string& source) const
         }
     }
 
-    /* add ast info to prog */
-    parser::parse(prog.get(), filename, source.c_str());
-
-    /* add source_code info to prog */
-    auto* source_code_relation = prog->getRelation("source_code");
-    source_code_relation->insert(
-        souffle::tuple(source_code_relation, {prog->getSymbolTable().encode(filename),
-                                              prog->getSymbolTable().encode(source)}));
+    /* add ast info to prog, facts are inserted while parsing */
+    {
+        auto span = timer::span("parse");
+        if (parser::parse(prog.get(), filename, std::move(tokens), deadline) ==
+            parser::PARSE_TIMEOUT) {
+            return {};
+        }
+    }
 
     /* run program */
-    prog->run();
+    {
+        auto span = timer::span("souffle");
+        auto rss_before = current_souffle_samples != nullptr ? resident_bytes() : 0;
+        auto run_start = std::chrono::steady_clock::now();
+        prog->run();
+        if (current_souffle_samples != nullptr) {
+            current_souffle_samples->time +=
+                (std::chrono::steady_clock::now() - run_start).count();
+        }
+        if (current_souffle_samples != nullptr && rss_before > 0) {
+            auto rss_after = resident_bytes();
+            store_max(current_souffle_samples->peak, rss_after);
+            store_max(current_souffle_samples->growth, rss_after - std::min(rss_before, rss_after));
+        }
+    }
     // prog->printAll();
 
     /* extract rewrites */
+    auto span = timer::span("extract");
     auto* relation = prog->getRelation("replace_range_with_fragment");
     auto rewrites = std::set<std::pair<std::string, rewrite_type>>{};
 
@@ -528,6 +1908,17 @@ auto program::run_datalog_analysis(const std::string& source) const
         rewrites.emplace(rule, std::tuple(start, end, replacement));
     }
 
+    if (profile_rules) {
+        auto lock = std::unique_lock{profile_mutex};
+        profile.runs++;
+        for (auto* relation : prog->getAllRelations()) {
+            profile.relation_sizes[relation->getName()] += relation->size();
+        }
+        for (const auto& [rule, rewrite] : rewrites) {
+            profile.rewrites_per_rule[rule]++;
+        }
+    }
+
     return rewrites;
 }
 
@@ -2,11 +2,21 @@
 
 #include "parser/parser.h"
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <filesystem>
 #include <functional>
 #include <map>
+#include <memory>
+#include <mutex>
 #include <optional>
+#include <unordered_map>
 #include <unordered_set>
 #include <set>
+#include <thread>
 
 namespace logifix {
 
@@ -15,15 +25,108 @@ using node_id = size_t;
 using patch_id = size_t;
 using rewrite_type = std::tuple<size_t, size_t, std::string>;
 using rewrite_collection = std::vector<rewrite_type>;
+/* the rewrites found in a file, sorted by position */
+using finding_collection = std::vector<std::pair<rule_id, rewrite_type>>;
 
 struct node_data_type {
     node_id id;
     rule_id creation_rule;
     node_id parent;
+    node_id root;
     rewrite_collection creation_rewrites;
-    std::string source_code;
-    std::unordered_set<std::string> children_hashset;
+    /* hashes of the source code of the children */
+    std::unordered_multimap<uint64_t, node_id> children_hashes;
     std::vector<node_id> children;
+    /* the source code was dropped once the graph of the file was explored */
+    bool compacted = false;
+};
+
+/**
+ * What to do when the rewrites of two patches overlap. Either abort the
+ * run, drop the patches that were found last, or leave the file unchanged.
+ */
+enum class conflict_policy { abort, drop_patch, skip_file };
+
+struct merge_conflict {
+    node_id file;
+    /* the code fragment covered by the conflicting rewrites */
+    std::string fragment;
+    std::vector<rule_id> rules;
+    std::vector<rule_id> dropped_rules;
+};
+
+/**
+ * Cost of the Datalog analysis, aggregated over all Soufflé runs.
+ */
+struct rule_profile {
+    std::size_t runs = 0;
+    /* total number of tuples in each relation after each run */
+    std::map<std::string, std::size_t> relation_sizes;
+    std::map<rule_id, std::size_t> rewrites_per_rule;
+    std::unordered_map<node_id, std::chrono::steady_clock::duration> time_per_file;
+};
+
+/**
+ * Size of the rewrite graph of a file.
+ */
+struct graph_statistics {
+    std::size_t nodes = 0;
+    std::size_t merge_nodes = 0;
+    std::size_t max_depth = 0;
+    /* candidates that were found among the children of the parent node */
+    std::size_t deduplicated = 0;
+    std::size_t source_bytes = 0;
+    std::map<rule_id, std::size_t> children_per_rule;
+};
+
+/**
+ * Where the worker threads spent their time during the last run. Durations
+ * are summed over all threads.
+ */
+struct thread_statistics {
+    std::size_t threads = 0;
+    std::chrono::steady_clock::duration wall_time{};
+    /* waiting to acquire the work mutex */
+    std::chrono::steady_clock::duration lock_wait{};
+    /* waiting for work to become available */
+    std::chrono::steady_clock::duration condition_wait{};
+    /* analyzing nodes: lexing, parsing, running Soufflé and reading the
+     * rewrites, or reading them from the cache */
+    std::chrono::steady_clock::duration analysis{};
+    /* running Soufflé, part of the analysis, including the threads that
+     * analyze chunks of split files */
+    std::chrono::steady_clock::duration souffle{};
+    /* the number of idle workers and the time since the start of the run at
+     * which it changed */
+    std::vector<std::pair<std::chrono::steady_clock::duration, std::size_t>> idle_workers;
+};
+
+/**
+ * Memory held by the rewrite graph of a file, and the resident set size of
+ * the process sampled around its Soufflé runs. The resident set size is
+ * shared by all threads, so with more than one job it includes the memory
+ * of the files that were analyzed at the same time.
+ */
+struct memory_statistics {
+    /* estimated heap memory of the nodes, their source code and rewrites */
+    std::size_t graph_bytes = 0;
+    /* the largest resident set size right after a Soufflé run */
+    std::size_t peak_rss = 0;
+    /* the largest growth of the resident set size during a Soufflé run */
+    std::size_t peak_rss_growth = 0;
+};
+
+/**
+ * The progress of a run. Can be taken from any thread while run is active.
+ */
+struct progress_snapshot {
+    std::size_t files = 0;
+    /* files whose rewrite graph has been explored, or that were skipped */
+    std::size_t finished_files = 0;
+    std::size_t analyzed_nodes = 0;
+    /* the unfinished file that was started first */
+    std::optional<node_id> slowest_file;
+    std::chrono::steady_clock::duration slowest_file_time{};
 };
 
 class program {
@@ -31,40 +134,152 @@ class program {
 private:
 
     std::unordered_set<rule_id> disabled_rules;
+    std::unordered_map<rule_id, std::vector<std::string>> rule_triggers;
     std::deque<node_id> pending_root_nodes;
     std::deque<node_id> pending_child_nodes;
-    size_t id_counter = 0;
-    std::unordered_map<node_id, node_data_type> node_data;
+    /* nodes and their source code are indexed by node id, elements are never
+     * moved so references stay valid while other threads add nodes */
+    std::deque<node_data_type> node_data;
+    std::deque<std::string> node_sources;
+    std::optional<std::chrono::milliseconds> timeout;
+    std::unordered_map<node_id, std::chrono::steady_clock::time_point> deadlines;
+    std::set<node_id> timed_out_files;
+    std::optional<std::size_t> memory_limit;
+    std::set<node_id> memory_limited_files;
+    std::unordered_map<node_id, memory_statistics> memory_per_file;
+    std::unordered_map<node_id, std::size_t> deduplicated_per_file;
+    conflict_policy on_conflict = conflict_policy::abort;
+    std::set<node_id> conflicted_files;
+    /* appended to by get_result, which is otherwise read-only */
+    mutable std::vector<merge_conflict> merge_conflicts;
+    bool profile_rules = false;
+    size_t jobs = std::max(std::thread::hardware_concurrency(), 1u);
+    size_t split_threshold = 0;
+    std::unordered_set<rule_id> file_level_rules;
+    std::optional<std::filesystem::path> cache_directory;
+    bool lazy = false;
+    std::unordered_set<patch_id> deferred_patches;
+    /* guards the nodes and the queues while run is active, public methods
+     * that may be called during run lock it */
+    mutable std::mutex work_mutex;
+    std::condition_variable work_cv;
+    bool serving = false;
+    /* the number of queued and running nodes of every file */
+    std::unordered_map<node_id, std::size_t> pending_per_file;
+    /* the prefix hashes of a parent are computed by the first of its queued
+     * children that needs them, and dropped when the last one is finished */
+    struct shared_prefix_hashes {
+        std::shared_ptr<const std::vector<uint64_t>> hashes;
+        std::size_t pending_children = 0;
+    };
+    std::unordered_map<node_id, shared_prefix_hashes> parent_prefix_hashes;
+    /* notified when the last queued node of a file has been finished */
+    std::condition_variable file_done_cv;
+    std::vector<patch_id> published_patches;
+    /* progress counters, read without the work mutex */
+    std::atomic<std::size_t> file_count = 0;
+    std::atomic<std::size_t> analyzed_files = 0;
+    std::atomic<std::size_t> finished_files = 0;
+    std::atomic<std::size_t> analyzed_nodes = 0;
+    mutable std::mutex in_progress_mutex;
+    std::unordered_map<node_id, std::chrono::steady_clock::time_point> in_progress_files;
+    /* set in scan mode, called from the worker threads */
+    std::function<void(node_id, const std::string&, const finding_collection&)> report_findings;
+    /* updated by concurrent analyses */
+    mutable std::mutex profile_mutex;
+    mutable rule_profile profile;
+    thread_statistics thread_stats;
+    /* patches are indexed as they are created, patches of disabled rules
+     * are not indexed */
+    std::vector<patch_id> all_patches;
+    std::unordered_map<rule_id, std::vector<patch_id>> patches_by_rule;
+    std::unordered_map<node_id, std::vector<patch_id>> patches_by_file;
 
-    auto
-    run_datalog_analysis(const std::string&) const -> std::set<std::pair<rule_id, rewrite_type>>;
+    auto run_datalog_analysis(const std::string&, const parser::deadline_type&, size_t) const
+        -> std::optional<std::set<std::pair<rule_id, rewrite_type>>>;
+    auto run_datalog_analysis(const std::string&, parser::token_collection,
+                              const parser::deadline_type&, size_t) const
+        -> std::optional<std::set<std::pair<rule_id, rewrite_type>>>;
+    auto run_cached_analysis(const std::string&, const parser::token_collection&,
+                             const std::vector<std::pair<size_t, size_t>>&,
+                             const parser::deadline_type&, size_t) const
+        -> std::optional<std::set<std::pair<rule_id, rewrite_type>>>;
     auto print_performance_metrics() -> void;
     auto print_merge_conflict(const std::string&, rewrite_collection, const std::vector<node_id>&) const -> void;
-    auto create_id() -> size_t;
-    auto apply_rewrite(const std::string&, const rewrite_type&) const -> std::string;
-    auto apply_rewrites(const std::string&, rewrite_collection) const -> std::string;
+    auto record_merge_conflict(node_id, const std::string&, rewrite_collection,
+                               const std::vector<node_id>&, const std::vector<node_id>&) const
+        -> void;
+    auto is_skipped_file(node_id) const -> bool;
+    auto create_node(node_data_type, std::string) -> node_id;
+    auto exceeds_memory_limit(node_id) -> bool;
     auto adjust_rewrites(const rewrite_collection&, const rewrite_collection&) const -> rewrite_collection;
     auto rewrites_invert(const std::string&, rewrite_collection) const -> rewrite_collection;
     auto rewrite_collections_overlap(const rewrite_collection&,
                                           const rewrite_collection&) const -> bool;
     auto rewrite_collection_overlap(const rewrite_collection&) const -> bool;
-    auto split_rewrite(const std::string& original, const rewrite_type&) const -> rewrite_collection;
-    auto get_recursive_merge_result_for_node(node_id) const -> std::string;
+    auto get_merge_result_node(node_id) const -> node_id;
+    auto get_recursive_merge_result_for_node(node_id) const -> const std::string&;
+    auto rebuild_source(node_id) const -> std::string;
+    auto compact_file(node_id) -> void;
+    auto count_candidate_rules(const parser::token_collection&) const -> size_t;
+    auto estimate_cost(const std::string&) const -> size_t;
+    auto schedule_root_nodes() -> void;
+    auto process_pending_nodes() -> void;
+    auto queue_child_node(node_id) -> void;
+    auto finish_node(const node_data_type&) -> void;
+    auto is_split(const std::string&) const -> bool;
+    auto analysis_threads_for(const std::string&) const -> size_t;
+    auto index_patch(const node_data_type&) -> void;
+    auto remove_patches_for_file(node_id) -> void;
+    auto sort_patch_indexes() -> void;
     auto post_process(const std::string&, const std::string&) const -> std::string;
 
 public:
 
+    /* rewrite helpers, these do not depend on the state of the program */
+    auto apply_rewrite(const std::string&, const rewrite_type&) const -> std::string;
+    auto apply_rewrites(const std::string&, rewrite_collection) const -> std::string;
+    auto split_rewrite(const std::string& original, const rewrite_type&) const -> rewrite_collection;
+
     auto add_file(const std::string&) -> node_id;
-    auto run(std::function<void(node_id)>) -> void;
+    auto run() -> void;
+    auto enable_lazy_mode() -> void;
+    auto expand(const std::vector<patch_id>&) -> void;
+    auto has_patch(patch_id) const -> bool;
+    auto set_serving(bool) -> void;
+    auto cancel_pending_files() -> void;
+    auto take_published_patches() -> std::vector<std::pair<rule_id, patch_id>>;
+    auto wait_for_published_patches() -> void;
+    auto count_analyzed_files() const -> size_t;
+    auto get_progress() const -> progress_snapshot;
     auto disable_rule(const rule_id&) -> void;
+    auto set_rule_triggers(const rule_id&, std::vector<std::string>) -> void;
+    auto set_timeout(std::chrono::milliseconds) -> void;
+    auto set_jobs(size_t) -> void;
+    auto set_split_threshold(size_t) -> void;
+    auto add_file_level_rule(const rule_id&) -> void;
+    auto set_cache_directory(std::filesystem::path) -> void;
+    auto get_timed_out_files() const -> std::vector<node_id>;
+    auto set_memory_limit(size_t) -> void;
+    auto get_memory_limited_files() const -> std::vector<node_id>;
+    auto get_memory_statistics() const -> std::unordered_map<node_id, memory_statistics>;
+    auto set_conflict_policy(conflict_policy) -> void;
+    auto get_merge_conflicts() const -> const std::vector<merge_conflict>&;
+    auto get_conflicted_files() const -> std::vector<node_id>;
+    auto enable_rule_profiling() -> void;
+    auto enable_scan_mode(
+        std::function<void(node_id, const std::string&, const finding_collection&)>) -> void;
+    auto get_rule_profile() const -> const rule_profile&;
+    auto get_graph_statistics(node_id) const -> graph_statistics;
+    auto get_thread_statistics() const -> const thread_statistics&;
     auto print_graphviz_data() const -> void;
     auto add_relations(node_id id, std::vector<std::tuple<node_id, node_id, std::string>>& result) const -> void;
     auto print_json_relations(node_id) const -> void;
     auto print_json_data(node_id, std::string) const -> void;
     auto get_patch_data(patch_id) const -> std::tuple<rule_id, node_id, std::string>;
-    auto get_all_patches() const -> std::vector<patch_id>;
-    auto get_patches_for_rule(const rule_id&) const -> std::vector<patch_id>;
-    auto get_patches_for_file(node_id) const -> std::vector<patch_id>;
+    auto get_all_patches() const -> const std::vector<patch_id>&;
+    auto get_patches_for_rule(const rule_id&) const -> const std::vector<patch_id>&;
+    auto get_patches_for_file(node_id) const -> const std::vector<patch_id>&;
     auto get_result(node_id, const std::vector<patch_id>&) const -> std::string;
 
 };
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cassert>
+#include <chrono>
 #include <fstream>
 #include <iostream>
 #include <souffle/SouffleInterface.h>
@@ -47,7 +48,16 @@ using token_collection = std::vector<token>;
 
 std::optional<token_collection> lex(const std::string& content);
 
-int parse(souffle::SouffleProgram* program, const char* filename, const char* content);
+/* Point in time after which parsing is aborted */
+using deadline_type = std::optional<std::chrono::steady_clock::time_point>;
+
+/* Returned by parse when the deadline was reached */
+constexpr int PARSE_TIMEOUT = -1;
+
+int parse(souffle::SouffleProgram* program, const char* filename, const char* content,
+          const deadline_type& deadline = {});
+int parse(souffle::SouffleProgram* program, const char* filename, token_collection tokens,
+          const deadline_type& deadline = {});
 
 inline std::string token_collection_to_string(const token_collection& tokens) {
     std::string result;
@@ -2,10 +2,11 @@
 %glr-parser
 %language "c++"
 %locations
-%parse-param {souffle::SouffleProgram *program}
+%parse-param {logifix::parser::ast_builder& ast}
 %param {const char* filename}
 %param {std::vector<logifix::parser::token>& tokens}
 %param {size_t& pos}
+%param {const logifix::parser::deadline_type& deadline}
 %expect 1089
 %expect-rr 802
 %define api.location.type {logifix::parser::location}
@@ -13,12 +14,40 @@
 %code requires
 {
 #include <souffle/SouffleInterface.h>
+#include <cstdlib>
 #include <stack>
+#include <unordered_map>
 #include <unordered_set>
+#include <vector>
 #include <iomanip>
 #include "parser.h"
 #define YYINITDEPTH  50000
 #define YYMAXDEPTH   100000
+#define YYMALLOC     logifix::parser::allocate_parser_stack
+#define YYFREE       logifix::parser::free_parser_stack
+
+namespace logifix::parser {
+
+/**
+ * The relations that the semantic actions insert into, looked up once per
+ * parse. The children of every node are also kept here, so that copying a
+ * node does not have to scan the relations.
+ */
+struct ast_builder {
+    souffle::SouffleProgram* program;
+    souffle::Relation* root;
+    souffle::Relation* parent_of;
+    souffle::Relation* parent_of_list;
+    /* symbols by the address of the string literal they were encoded from */
+    std::unordered_map<const char*, souffle::RamDomain> symbols;
+    std::unordered_map<int, std::vector<std::pair<souffle::RamDomain, int>>> children;
+    std::unordered_map<int, std::vector<std::pair<souffle::RamDomain, int>>> child_lists;
+};
+
+void* allocate_parser_stack(size_t size);
+void free_parser_stack(void* stack);
+
+}
 }
 
 /* undefined token */
@@ -1890,36 +1919,69 @@ switch_expression: SWITCH '(' expression ')' switch_block
     while (false)
 
 #define NIL 0
-#define ROOT(id) insert_root(program, id)
-#define ID(name, loc) create_id(program, name, loc)
-#define COPY_ID(child, loc) copy_id(program, child, loc)
-#define LIST(head, tail) create_id_list(program, head, tail)
-#define PARENT(parent, name, child) insert_parent_of(program, parent, name, child)
-#define PARENT_LIST(parent, name, children) insert_parent_of_list(program, parent, name, children)
+#define ROOT(id) insert_root(ast, id)
+#define ID(name, loc) create_id(ast, name, loc)
+#define COPY_ID(child, loc) copy_id(ast, child, loc)
+#define LIST(head, tail) create_id_list(ast, head, tail)
+#define PARENT(parent, name, child) insert_parent_of(ast, parent, name, child)
+#define PARENT_LIST(parent, name, children) insert_parent_of_list(ast, parent, name, children)
 #define INFIX(parent, name, loc, left, right) do { parent = ID(name, loc); PARENT(parent, "left", left); PARENT(parent, "right", right); } while (0)
 
-int create_id_list(souffle::SouffleProgram* program, int head, int tail) {
+using logifix::parser::ast_builder;
+
+souffle::RamDomain encode(ast_builder& ast, const char* symbol) {
+    auto it = ast.symbols.find(symbol);
+    if (it == ast.symbols.end()) {
+        it = ast.symbols.emplace(symbol, ast.program->getSymbolTable().encode(symbol)).first;
+    }
+    return it->second;
+}
+
+int create_id_list(ast_builder& ast, int head, int tail) {
     std::array<souffle::RamDomain, 2> arr = {head, tail};
-    int result = program->getRecordTable().pack(arr.data(), 2);
+    int result = ast.program->getRecordTable().pack(arr.data(), 2);
     return result;
 }
 
-int create_id(souffle::SouffleProgram* program, const char* type, const logifix::parser::location& loc) {
+int create_id(ast_builder& ast, const char* type, const logifix::parser::location& loc) {
     assert(type != nullptr);
     assert(loc.filename != nullptr);
     std::array<souffle::RamDomain, 6> arr = {
-        program->getSymbolTable().encode(type),
-        program->getSymbolTable().encode(loc.filename),
+        encode(ast, type),
+        encode(ast, loc.filename),
         souffle::RamDomain(loc.begin),
         souffle::RamDomain(loc.end),
         souffle::RamDomain(loc.begin),
         souffle::RamDomain(loc.end)
     };
-    return program->getRecordTable().pack(arr.data(), arr.size());
+    return ast.program->getRecordTable().pack(arr.data(), arr.size());
 }
 
-int copy_id(souffle::SouffleProgram* program, int child, const logifix::parser::location& loc) {
-    auto* ptr = program->getRecordTable().unpack(child, 6);
+void insert_child(souffle::Relation* relation,
+                  std::unordered_map<int, std::vector<std::pair<souffle::RamDomain, int>>>& index,
+                  int parent, souffle::RamDomain name, int child) {
+    assert(relation != nullptr);
+    relation->insert(souffle::tuple(relation, {parent, name, child}));
+    index[parent].emplace_back(name, child);
+}
+
+/* copy the children of a node to another node, the children are copied
+ * first as the index may grow while inserting */
+void copy_children(souffle::Relation* relation,
+                   std::unordered_map<int, std::vector<std::pair<souffle::RamDomain, int>>>& index,
+                   int from, int to) {
+    auto it = index.find(from);
+    if (it == index.end()) {
+        return;
+    }
+    auto children = it->second;
+    for (auto [name, child] : children) {
+        insert_child(relation, index, to, name, child);
+    }
+}
+
+int copy_id(ast_builder& ast, int child, const logifix::parser::location& loc) {
+    auto* ptr = ast.program->getRecordTable().unpack(child, 6);
     std::array<souffle::RamDomain, 6> arr = {
         ptr[0],
         ptr[1],
@@ -1928,54 +1990,23 @@ int copy_id(souffle::SouffleProgram* program, int child, const logifix::parser::
         souffle::RamDomain(loc.begin),
         souffle::RamDomain(loc.end)
     };
-    auto new_id = program->getRecordTable().pack(arr.data(), arr.size());
-    auto* parent_of = program->getRelation("parent_of");
-    std::vector<std::tuple<int,std::string,int>> parent_of_tuples;
-    for (souffle::tuple& output : *parent_of) {
-        int x;
-        std::string symbol;
-        int y;
-        output >> x >> symbol >> y;
-        if (x == child) {
-            parent_of_tuples.emplace_back(new_id, symbol, y);
-        }
-    }
-    for (auto [x, symbol, y] : parent_of_tuples) {
-        parent_of->insert(souffle::tuple(parent_of, {x, program->getSymbolTable().encode(symbol), y}));
-    }
-    auto* parent_of_list = program->getRelation("parent_of_list");
-    std::vector<std::tuple<int,std::string,int>> parent_of_list_tuples;
-    for (souffle::tuple& output : *parent_of_list) {
-        int x;
-        std::string symbol;
-        int y;
-        output >> x >> symbol >> y;
-        if (x == child) {
-            parent_of_list_tuples.emplace_back(new_id, symbol, y);
-        }
-    }
-    for (auto [x, symbol, y] : parent_of_list_tuples) {
-        parent_of_list->insert(souffle::tuple(parent_of_list, {x, program->getSymbolTable().encode(symbol), y}));
-    }
+    auto new_id = ast.program->getRecordTable().pack(arr.data(), arr.size());
+    copy_children(ast.parent_of, ast.children, child, new_id);
+    copy_children(ast.parent_of_list, ast.child_lists, child, new_id);
     return new_id;
 }
 
-void insert_root(souffle::SouffleProgram* program, int id) {
-    auto* relation = program->getRelation("root");
-    assert(relation != nullptr);
-    relation->insert(souffle::tuple(relation, {id}));
+void insert_root(ast_builder& ast, int id) {
+    assert(ast.root != nullptr);
+    ast.root->insert(souffle::tuple(ast.root, {id}));
 }
 
-void insert_parent_of(souffle::SouffleProgram* program, int parent, const char* name, int child) {
-    auto* relation = program->getRelation("parent_of");
-    assert(relation != nullptr);
-    relation->insert(souffle::tuple(relation, {parent, program->getSymbolTable().encode(name), child}));
+void insert_parent_of(ast_builder& ast, int parent, const char* name, int child) {
+    insert_child(ast.parent_of, ast.children, parent, encode(ast, name), child);
 }
 
-void insert_parent_of_list(souffle::SouffleProgram* program, int parent, const char* name, int children) {
-    auto* relation = program->getRelation("parent_of_list");
-    assert(relation != nullptr);
-    relation->insert(souffle::tuple(relation, {parent, program->getSymbolTable().encode(name), children}));
+void insert_parent_of_list(ast_builder& ast, int parent, const char* name, int children) {
+    insert_child(ast.parent_of_list, ast.child_lists, parent, encode(ast, name), children);
 }
 
 /* Build this table with /\([A-Z]\+\)/{"\L\1\e", yy::parser::token::\1}, in vim */
@@ -2071,16 +2102,21 @@ std::unordered_map<std::string, int> operators = {
     {"||", yy::parser::token::LOGICAL_OR},
 };
 
-int yylex(int* yylval, logifix::parser::location* yylloc, const char* filename, std::vector<logifix::parser::token>& tokens, size_t& pos) {
+int yylex(int* yylval, logifix::parser::location* yylloc, const char* filename, std::vector<logifix::parser::token>& tokens, size_t& pos, const logifix::parser::deadline_type& deadline) {
     assert(filename != nullptr);
 
+    /* Abort the parse by producing an undefined token when out of time */
+    if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+        return yy::parser::token::UNDEFINED;
+    }
+
     /* Skip non-semantic tokens */
-    std::unordered_set skip = {
-        logifix::parser::token_type::whitespace,
-        logifix::parser::token_type::single_line_comment,
-        logifix::parser::token_type::multi_line_comment
+    auto skip = [](logifix::parser::token_type type) {
+        return type == logifix::parser::token_type::whitespace ||
+               type == logifix::parser::token_type::single_line_comment ||
+               type == logifix::parser::token_type::multi_line_comment;
     };
-    while (tokens.size() && skip.find(std::get<0>(tokens.back())) != skip.end()) {
+    while (tokens.size() && skip(std::get<0>(tokens.back()))) {
        pos += std::get<1>(tokens.back()).size();
        tokens.pop_back();
     }
@@ -2088,7 +2124,7 @@ int yylex(int* yylval, logifix::parser::location* yylloc, const char* filename,
     if (tokens.size() == 0) {
         return yy::parser::token::UNDEFINED;
     }
-    auto [type, content] = tokens.back();
+    auto [type, content] = std::move(tokens.back());
     tokens.pop_back();
     auto start = pos;
     auto end = pos + content.size();
@@ -2100,14 +2136,14 @@ int yylex(int* yylval, logifix::parser::location* yylloc, const char* filename,
         return yy::parser::token::IDENTIFIER;
     }
     if (type == logifix::parser::token_type::restricted) {
-        auto it = restricted.find(std::string(content));
+        auto it = restricted.find(content);
         if (it == restricted.end()) {
             return yy::parser::token::UNDEFINED;
         }
         return it->second;
     }
     if (type == logifix::parser::token_type::keyword) {
-        auto it = keywords.find(std::string(content));
+        auto it = keywords.find(content);
         if (it == keywords.end()) {
             return yy::parser::token::UNDEFINED;
         }
@@ -2142,7 +2178,7 @@ int yylex(int* yylval, logifix::parser::location* yylloc, const char* filename,
     }
     if (type == logifix::parser::token_type::op) {
         if (content.size() == 1) return content[0];
-        auto it = operators.find(std::string(content));
+        auto it = operators.find(content);
         if (it == operators.end()) {
             return yy::parser::token::UNDEFINED;
         }
@@ -2171,7 +2207,46 @@ void parser::error(const logifix::parser::location& loc, const std::string& msg)
 
 namespace logifix::parser {
 
-int parse(souffle::SouffleProgram* program, const char* filename, const char* content) {
+namespace {
+/* parser stacks smaller than this are not reused */
+constexpr auto MIN_REUSED_STACK_BYTES = size_t{64 * 1024};
+
+/**
+ * The largest parser stack allocated by a thread, kept for the next parse
+ * so that the stack of YYINITDEPTH items is allocated once per thread.
+ */
+struct stack_cache {
+    void* stack = nullptr;
+    size_t size = 0;
+    bool in_use = false;
+    ~stack_cache() { std::free(stack); }
+};
+thread_local stack_cache cache;
+} // namespace
+
+void* allocate_parser_stack(size_t size) {
+    if (size < MIN_REUSED_STACK_BYTES || cache.in_use) {
+        return std::malloc(size);
+    }
+    if (cache.size < size) {
+        std::free(cache.stack);
+        cache.stack = std::malloc(size);
+        cache.size = cache.stack != nullptr ? size : 0;
+    }
+    cache.in_use = cache.stack != nullptr;
+    return cache.stack;
+}
+
+void free_parser_stack(void* stack) {
+    if (stack != nullptr && stack == cache.stack) {
+        cache.in_use = false;
+        return;
+    }
+    std::free(stack);
+}
+
+int parse(souffle::SouffleProgram* program, const char* filename, const char* content,
+          const deadline_type& deadline) {
     assert(filename != nullptr);
     assert(content != nullptr);
 
@@ -2189,11 +2264,26 @@ int parse(souffle::SouffleProgram* program, const char* filename, const char* co
     }
     std::cerr << "===============" << std::endl;
 #endif
-    std::reverse(tokens->begin(), tokens->end());
+    return parse(program, filename, std::move(*tokens), deadline);
+}
+
+int parse(souffle::SouffleProgram* program, const char* filename, token_collection tokens,
+          const deadline_type& deadline) {
+    assert(filename != nullptr);
     assert(program != nullptr);
+    std::reverse(tokens.begin(), tokens.end());
     size_t pos = 0;
-    yy::parser parser(program, filename, *tokens, pos);
-    return parser();
+    auto ast = ast_builder{};
+    ast.program = program;
+    ast.root = program->getRelation("root");
+    ast.parent_of = program->getRelation("parent_of");
+    ast.parent_of_list = program->getRelation("parent_of_list");
+    yy::parser parser(ast, filename, tokens, pos, deadline);
+    auto result = parser();
+    if (deadline && std::chrono::steady_clock::now() >= *deadline) {
+        return PARSE_TIMEOUT;
+    }
+    return result;
 }
 
 }
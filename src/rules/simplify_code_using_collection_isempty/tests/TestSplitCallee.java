@@ -0,0 +1,32 @@
+import java.util.ArrayList;
+import java.util.List;
+
+class TestSplitCallee {
+    List<String> items() {
+        /*
+         * This comment makes the method larger than a chunk when the file is
+         * analyzed with --split-above=1, so that the call in test is analyzed
+         * in another chunk than this declaration. The call is only typed as a
+         * list when the header of this method is part of that chunk.
+         *
+         * The quick brown fox jumps over the lazy dog, line 1 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 2 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 3 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 4 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 5 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 6 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 7 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 8 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 9 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 10 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 11 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 12 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 13 of the filler.
+         * The quick brown fox jumps over the lazy dog, line 14 of the filler.
+         */
+        return new ArrayList<>();
+    }
+    void test() {
+        if (items().size() == 0) System.out.println("empty");
+    }
+}
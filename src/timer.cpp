@@ -1,33 +1,112 @@
 #include "timer.h"
+#include "utils.h"
+#include <atomic>
+#include <fmt/core.h>
+#include <fstream>
+#include <memory>
 #include <mutex>
 
 namespace timer {
 
-using std::chrono::duration_cast;
-using std::chrono::high_resolution_clock;
-using std::chrono::microseconds;
-
-std::vector<std::chrono::time_point<std::chrono::high_resolution_clock>> start_times;
-std::vector<std::string> event_data;
-std::vector<std::pair<size_t, std::string>> events;
+using std::chrono::steady_clock;
 
 namespace {
-std::mutex timer_mutex;
+std::atomic<bool> enabled = false;
+steady_clock::time_point epoch;
+
+/* the buffers outlive their threads so that spans can be collected after
+ * the worker threads have been joined */
+std::mutex buffers_mutex;
+std::vector<std::unique_ptr<std::vector<span_data>>> buffers;
+
+thread_local std::vector<span_data>* buffer = nullptr;
+thread_local std::size_t thread_index = 0;
+thread_local std::size_t context_file = NO_ID;
+thread_local std::size_t context_node = NO_ID;
+
+auto thread_buffer() -> std::vector<span_data>& {
+    if (buffer == nullptr) {
+        auto lock = std::unique_lock{buffers_mutex};
+        thread_index = buffers.size();
+        buffers.emplace_back(std::make_unique<std::vector<span_data>>());
+        buffer = buffers.back().get();
+    }
+    return *buffer;
+}
 } // namespace
 
-auto create(const std::string& name) -> size_t {
-    auto lock = std::unique_lock{timer_mutex};
-    auto id = start_times.size();
-    start_times.emplace_back(high_resolution_clock::now());
-    event_data.emplace_back(name);
-    return id;
+auto enable() -> void {
+    epoch = steady_clock::now();
+    enabled = true;
+}
+
+auto is_enabled() -> bool { return enabled; }
+
+auto set_context(std::size_t file, std::size_t node) -> void {
+    context_file = file;
+    context_node = node;
 }
 
-auto stop(size_t id) -> void {
-    auto lock = std::unique_lock{timer_mutex};
-    auto end = high_resolution_clock::now();
-    auto diff = duration_cast<microseconds>(end - start_times[id]).count();
-    events.emplace_back(diff, event_data[id]);
+auto get_spans() -> std::vector<span_data> {
+    auto lock = std::unique_lock{buffers_mutex};
+    auto result = std::vector<span_data>{};
+    for (const auto& spans : buffers) {
+        result.insert(result.end(), spans->begin(), spans->end());
+    }
+    return result;
 }
 
+/**
+ * Write all spans as complete events in the Chrome trace event format,
+ * which can be opened in chrome://tracing or Perfetto.
+ */
+auto write_chrome_trace(const std::string& path,
+                        const std::unordered_map<std::size_t, std::string>& file_names) -> void {
+    auto to_microseconds = [](steady_clock::duration duration) {
+        return std::chrono::duration<double, std::micro>(duration).count();
+    };
+    auto f = std::ofstream(path);
+    f << "{\"traceEvents\": [\n";
+    f << "    {\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": "
+         "\"logifix\"}}";
+    for (const auto& span : get_spans()) {
+        auto args = std::string{};
+        if (span.file != NO_ID) {
+            args += fmt::format("\"file\": {}", span.file);
+            auto it = file_names.find(span.file);
+            if (it != file_names.end()) {
+                args += fmt::format(", \"filename\": \"{}\"", utils::json_escape(it->second));
+            }
+        }
+        if (span.node != NO_ID) {
+            args += fmt::format("{}\"node\": {}", args.empty() ? "" : ", ", span.node);
+        }
+        f << fmt::format(",\n    {{\"name\": \"{}\", \"cat\": \"logifix\", \"ph\": \"X\", "
+                         "\"ts\": {:.3f}, \"dur\": {:.3f}, \"pid\": 1, \"tid\": {}, "
+                         "\"args\": {{{}}}}}",
+                         span.name, to_microseconds(span.start - epoch),
+                         to_microseconds(span.end - span.start), span.thread, args);
+    }
+    f << "\n]}\n";
+}
+
+span::span(const char* name) : span(name, context_file, context_node) {}
+
+span::span(const char* name, std::size_t file, std::size_t node)
+    : name(name), file(file), node(node), active(enabled) {
+    if (active) {
+        start = steady_clock::now();
+    }
+}
+
+span::~span() {
+    if (active) {
+        auto end = steady_clock::now();
+        auto& spans = thread_buffer();
+        spans.push_back({name, start, end, file, node, thread_index});
+    }
+}
+
+auto span::set_file(std::size_t id) -> void { file = id; }
+
 } // namespace timer
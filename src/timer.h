@@ -1,19 +1,64 @@
 #pragma once
 
+#include <chrono>
 #include <cstdlib>
 #include <string>
+#include <unordered_map>
 #include <vector>
-#include <chrono>
 
 namespace timer {
 
-extern std::vector<std::chrono::time_point<std::chrono::high_resolution_clock>> start_times;
-extern std::vector<std::string> event_data;
+/* Used for spans that do not belong to a file or a node */
+constexpr auto NO_ID = static_cast<std::size_t>(-1);
+
+struct span_data {
+    const char* name;
+    std::chrono::steady_clock::time_point start;
+    std::chrono::steady_clock::time_point end;
+    std::size_t file;
+    std::size_t node;
+    std::size_t thread;
+};
+
+auto enable() -> void;
+
+auto is_enabled() -> bool;
+
+/**
+ * Set the file and node that the following spans on this thread belong to.
+ */
+auto set_context(std::size_t file, std::size_t node) -> void;
+
+/**
+ * Collect the spans of all threads. Must not be called while other threads
+ * are recording spans.
+ */
+auto get_spans() -> std::vector<span_data>;
+
+auto write_chrome_trace(const std::string& path,
+                        const std::unordered_map<std::size_t, std::string>& file_names) -> void;
 
-extern std::vector<std::pair<size_t, std::string>> events;
+/**
+ * Record the time between construction and destruction as a span. Spans are
+ * appended to a buffer owned by the current thread, so recording does not
+ * take any locks. Nothing is recorded unless timing has been enabled.
+ */
+class span {
+  public:
+    explicit span(const char* name);
+    span(const char* name, std::size_t file, std::size_t node);
+    span(const span&) = delete;
+    auto operator=(const span&) -> span& = delete;
+    ~span();
 
-auto create(const std::string& name) -> std::size_t;
+    auto set_file(std::size_t id) -> void;
 
-auto stop(std::size_t id) -> void;
+  private:
+    const char* name;
+    std::size_t file;
+    std::size_t node;
+    bool active;
+    std::chrono::steady_clock::time_point start;
+};
 
-}
+} // namespace timer
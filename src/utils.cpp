@@ -116,4 +116,41 @@ auto detect_line_terminator(const std::string& str) -> std::string {
     return "\n";
 }
 
+/**
+ * Escape a string for use inside a quoted JSON string.
+ */
+auto json_escape(const std::string& str) -> std::string {
+    auto result = std::string{};
+    result.reserve(str.size());
+    for (auto c : str) {
+        switch (c) {
+        case '"':
+            result += "\\\"";
+            break;
+        case '\\':
+            result += "\\\\";
+            break;
+        case '\n':
+            result += "\\n";
+            break;
+        case '\r':
+            result += "\\r";
+            break;
+        case '\t':
+            result += "\\t";
+            break;
+        default:
+            if (static_cast<unsigned char>(c) < 0x20) {
+                constexpr auto hex = "0123456789abcdef";
+                result += "\\u00";
+                result += hex[(c >> 4) & 0xf];
+                result += hex[c & 0xf];
+            } else {
+                result += c;
+            }
+        }
+    }
+    return result;
+}
+
 } // namespace utils
@@ -12,5 +12,6 @@ bool string_has_only_whitespace(const std::string& str);
 std::string::const_iterator find_first_non_space(const std::string& str);
 std::string detect_indentation(const std::string& str);
 std::string detect_line_terminator(const std::string& str);
+std::string json_escape(const std::string& str);
 
 } // namespace utils
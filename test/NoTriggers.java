@@ -0,0 +1,7 @@
+package com.example;
+
+enum NoTriggers {
+    RED,
+    GREEN,
+    BLUE
+}
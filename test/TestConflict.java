@@ -0,0 +1,5 @@
+class TestConflict {
+    boolean test(String s) {
+        return s.substring(s.length()).startsWith("a");
+    }
+}